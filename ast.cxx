@@ -1,8 +1,103 @@
 #include <algorithm>
 #include <cassert>
+#include <deque>
+#include <memory>
 #include <unordered_map>
 #include "ast.h"
 
+/* Deque, so that the names do not move while locations point to them */
+static std::deque<std::string> source_files;
+
+const std::string *SourceLoc::add_file(const std::string &name) {
+    assert(source_files.size() < 0xffff);
+    return &source_files.emplace_back(name);
+}
+
+static unsigned short file_index(const std::string *name) {
+    if (!name)
+        return 0;
+    for (size_t i = 0; i < source_files.size(); i++) {
+        if (&source_files[i] == name)
+            return i + 1;
+    }
+    assert(false && "location of a file not registered with SourceLoc::add_file");
+    return 0;
+}
+
+SourceLoc::SourceLoc(const yy::location &loc)
+    : begin_line(loc.begin.line), line_span(std::min(loc.end.line - loc.begin.line, 0xffff)),
+      begin_column(std::min(loc.begin.column, 0xffff)), end_column(std::min(loc.end.column, 0xffff)),
+      file(file_index(loc.begin.filename)) {}
+
+SourceLoc::operator yy::location() const {
+    const std::string *name = file ? &source_files[file - 1] : nullptr;
+    return yy::location(yy::position(name, begin_line, begin_column),
+                        yy::position(name, begin_line + line_span, end_column));
+}
+
+std::ostream &operator <<(std::ostream &out, const SourceLoc &loc) {
+    return out << static_cast<yy::location>(loc);
+}
+
+/* One per thread, so that no locking is needed */
+static thread_local struct {
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t used;
+    size_t size;
+} node_arena;
+
+static void *arena_allocate(size_t size) {
+    size = (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+    if (node_arena.used + size > node_arena.size) {
+        node_arena.size = std::max<size_t>(size, 64 * 1024);
+        node_arena.chunks.emplace_back(new char[node_arena.size]);
+        node_arena.used = 0;
+    }
+    void *memory = node_arena.chunks.back().get() + node_arena.used;
+    node_arena.used += size;
+    return memory;
+}
+
+void *Node::operator new(size_t size) {
+    return arena_allocate(size);
+}
+
+void Node::operator delete(void *) {}
+
+Node::ArenaMark Node::arena_mark() {
+    return {node_arena.chunks.size(), node_arena.used, node_arena.size};
+}
+
+/* Everything allocated since the mark must be dead by now */
+void Node::arena_release(ArenaMark mark) {
+    assert(mark.chunks <= node_arena.chunks.size());
+    node_arena.chunks.resize(mark.chunks);
+    node_arena.used = mark.used;
+    node_arena.size = mark.size;
+}
+
+NodeList::NodeList(const NodeList &other) {
+    assign(other.begin(), other.end());
+}
+
+NodeList &NodeList::operator =(const NodeList &other) {
+    if (this != &other) {
+        items = nullptr;
+        count = capacity = 0;
+        assign(other.begin(), other.end());
+    }
+    return *this;
+}
+
+void NodeList::reserve(size_t size) {
+    if (size <= capacity)
+        return;
+    Node **grown = static_cast<Node **>(arena_allocate(size * sizeof(Node *)));
+    std::copy(items, items + count, grown);
+    items = grown;
+    capacity = size;
+}
+
 Node::Node(yy::location loc, NodeKind kind) : loc(loc), kind(kind) {}
 
 Node::~Node() {
@@ -12,11 +107,20 @@ Node::~Node() {
 
 Program::Program(yy::location loc) : Node(loc, NodeKind::Program) {}
 
+Program::~Program() {
+    for (Const *constant : consts)
+        delete constant;
+}
+
 Function::Function(Type type, const std::string &name, std::vector<Parameter> params, Block *body, yy::location loc)
-    : Node(loc, NodeKind::Function), type(type), name(name), params(params), body(body) {
+    : Node(loc, NodeKind::Function), type(type), name(name), params(params), body(body),
+      memo(false), memo_capacity(0), hot(false), inline_hint(InlineHint::None), reachable(false) {
     children.emplace_back(body);
 }
 
+Const::Const(Type type, const std::string &name, long from, long to, Function *init, yy::location loc)
+    : Node(loc, NodeKind::Const), type(type), name(name), from(from), to(to), init(init) {}
+
 Statement::Statement(yy::location loc, StatementKind kind) : Node(loc, NodeKind::Statement), kind(kind) {}
 
 Block::Block(std::vector<Statement *> statements, yy::location loc) : Statement(loc, StatementKind::Block) {
@@ -35,13 +139,24 @@ Assignment::Assignment(const std::string &var_name, Expression *expr, yy::locati
 }
 
 While::While(Expression *pred, Statement *body, yy::location loc)
-    : Statement(loc, StatementKind::While), pred(pred), body(body) {
+    : Statement(loc, StatementKind::While), pred(pred), body(body), hint(BranchHint::None) {
     children.emplace_back(static_cast<Node *>(pred));
     children.emplace_back(static_cast<Node *>(body));
 }
 
+For::For(Variable *var, Expression *from, Expression *to, Expression *step, Statement *body, yy::location loc)
+    : Statement(loc, StatementKind::For), var(var), from(from), to(to), step(step), body(body) {
+    children.emplace_back(static_cast<Node *>(from));
+    children.emplace_back(static_cast<Node *>(to));
+    if (step)
+        children.emplace_back(static_cast<Node *>(step));
+    children.emplace_back(static_cast<Node *>(var));
+    children.emplace_back(static_cast<Node *>(body));
+}
+
 If::If(Expression *pred, Statement *positive, Statement *negative, yy::location loc)
-    : Statement(loc, StatementKind::If), pred(pred), positive(positive), negative(negative) {
+    : Statement(loc, StatementKind::If), pred(pred), positive(positive), negative(negative),
+      hint(BranchHint::None) {
     children.emplace_back(static_cast<Node *>(pred));
     children.emplace_back(static_cast<Node *>(positive));
     if (negative)
@@ -50,14 +165,46 @@ If::If(Expression *pred, Statement *positive, Statement *negative, yy::location
 
 If::If(Expression *pred, Statement *positive, yy::location loc) : If(pred, positive, nullptr, loc) {}
 
+Case::Case(Expression *expr, std::vector<CaseArm> arms, Statement *otherwise, yy::location loc)
+    : Statement(loc, StatementKind::Case), expr(expr), arms(arms), otherwise(otherwise) {
+    children.emplace_back(static_cast<Node *>(expr));
+    for (CaseArm &arm : arms) {
+        for (Expression *label : arm.labels)
+            children.emplace_back(static_cast<Node *>(label));
+        children.emplace_back(static_cast<Node *>(arm.body));
+    }
+    if (otherwise)
+        children.emplace_back(static_cast<Node *>(otherwise));
+}
+
+Parallel::Parallel(Variable *var, Expression *from, Expression *to, Statement *body, yy::location loc)
+    : Parallel(var, from, to, BinOpKind::Add, "", body, loc) {}
+
+Parallel::Parallel(Variable *var, Expression *from, Expression *to, BinOpKind reduction_kind,
+                   const std::string &reduction_var, Statement *body, yy::location loc)
+    : Statement(loc, StatementKind::Parallel), var(var), from(from), to(to), reduction_kind(reduction_kind),
+      reduction_var(reduction_var), body(body) {
+    children.emplace_back(static_cast<Node *>(from));
+    children.emplace_back(static_cast<Node *>(to));
+    children.emplace_back(static_cast<Node *>(var));
+    children.emplace_back(static_cast<Node *>(body));
+}
+
 Call::Call(const std::string &func_name, std::vector<Expression *> args, yy::location loc)
-    : Statement(loc, StatementKind::Call), func_name(func_name), args(args) {
+    : Statement(loc, StatementKind::Call), func_name(func_name), func(nullptr), args(args) {
     std::transform(args.begin(),
                    args.end(),
                    std::back_inserter(children),
                    [](Expression *expr){ return static_cast<Node *>(expr); });
 }
 
+Spawn::Spawn(const std::string &var_name, CallExpr *call, yy::location loc)
+    : Statement(loc, StatementKind::Spawn), var_name(var_name), call(call) {
+    children.emplace_back(static_cast<Node *>(call));
+}
+
+Sync::Sync(yy::location loc) : Statement(loc, StatementKind::Sync) {}
+
 Expression::Expression(yy::location loc, ExpressionKind kind) : Node(loc, NodeKind::Expression), kind(kind) {}
 
 BinOp::BinOp(BinOpKind kind, Expression *left, Expression *right, yy::location loc)
@@ -78,19 +225,29 @@ Boolean::Boolean(bool value, yy::location loc) : Expression(loc, ExpressionKind:
 Identifier::Identifier(std::string name, yy::location loc) : Expression(loc, ExpressionKind::Identifier), name(name) {}
 
 CallExpr::CallExpr(const std::string &func_name, std::vector<Expression *> args, yy::location loc)
-        : Expression(loc, ExpressionKind::CallExpr), func_name(func_name), args(args) {
+        : Expression(loc, ExpressionKind::CallExpr), func_name(func_name), func(nullptr), args(args) {
     std::transform(args.begin(),
                    args.end(),
                    std::back_inserter(children),
                    [](Expression *expr){ return static_cast<Node *>(expr); });
 }
 
+Index::Index(const std::string &table_name, Expression *index, yy::location loc)
+        : Expression(loc, ExpressionKind::Index), table_name(table_name), index(index), table(nullptr) {
+    children.emplace_back(static_cast<Node *>(index));
+}
+
 /* Utility functions */
 Type type_from_string(const std::string &type) {
     static std::unordered_map<std::string, Type> map = {
             {"int", Type::Int},
+            {"char", Type::Char},
+            {"int16", Type::Int16},
+            {"int32", Type::Int32},
             {"bool", Type::Bool},
             {"void", Type::Void},
+            {"int4", Type::Int4},
+            {"int8", Type::Int8},
     };
     return map[type];
 }
@@ -105,15 +262,72 @@ std::string type_to_string(Type type) {
             return "bool";
         case Type::Char:
             return "char";
+        case Type::Int16:
+            return "int16";
+        case Type::Int32:
+            return "int32";
         case Type::Void:
             return "void";
+        case Type::Int4:
+            return "int4";
+        case Type::Int8:
+            return "int8";
         default:
             assert(false);
     }
 }
 
+unsigned type_lanes(Type type) {
+    switch (type) {
+        case Type::Int4:
+            return 4;
+        case Type::Int8:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+unsigned type_bits(Type type) {
+    switch (type) {
+        case Type::Char:
+            return 8;
+        case Type::Int16:
+            return 16;
+        case Type::Int32:
+            return 32;
+        case Type::Int:
+            return 64;
+        default:
+            return 0;
+    }
+}
+
 bool is_builtin(const std::string &name) {
-    return name == "return" || name == "read" || name == "write";
+    return name == "return" || name == "read" || name == "write" || name == "read_char" || is_bit_builtin(name)
+           || is_conversion_builtin(name) || is_vector_builtin(name);
+}
+
+bool is_bit_builtin(const std::string &name) {
+    return name == "popcount" || name == "clz" || name == "ctz" || name == "bswap" || name == "rotl" || name == "rotr";
+}
+
+/* Conversions are named after the integer type converted to, e.g. int16(x) */
+bool is_conversion_builtin(const std::string &name) {
+    return name == "char" || name == "int16" || name == "int32" || name == "int";
+}
+
+bool is_vector_builtin(const std::string &name) {
+    static std::unordered_set<std::string> names = {
+        "splat4", "splat8", "vector", "lane", "insert", "shuffle", "select", "any", "all",
+        "reduce_add", "reduce_mul", "reduce_and", "reduce_or", "reduce_xor", "reduce_min", "reduce_max",
+    };
+    return names.contains(name);
+}
+
+bool is_exported(const std::string &name) {
+    /* Specialized clones are internal, e.g. xfoo.spec0 */
+    return (name[0] == 'x' && name.find('.') == std::string::npos) || name == "main";
 }
 
 BinOpKind resolve_relation_operator(const std::string &op) {
@@ -126,6 +340,203 @@ BinOpKind resolve_relation_operator(const std::string &op) {
     return map[op];
 }
 
+std::ostream &operator <<(std::ostream &out, BinOpKind kind) {
+    static std::unordered_map<BinOpKind, std::string> map = {
+        {BinOpKind::LogOr, "|"},
+        {BinOpKind::LogAnd, "&"},
+        {BinOpKind::LogXor, "^"},
+        {BinOpKind::Or, "or"},
+        {BinOpKind::And, "and"},
+        {BinOpKind::Xor, "xor"},
+        {BinOpKind::Eq, "="},
+        {BinOpKind::Gt, ">"},
+        {BinOpKind::Geq, ">="},
+        {BinOpKind::Lt, "<"},
+        {BinOpKind::Leq, "<="},
+        {BinOpKind::Add, "+"},
+        {BinOpKind::Mult, "*"},
+        {BinOpKind::Sub, "-"},
+        {BinOpKind::Shl, "shl"},
+        {BinOpKind::Shr, "shr"},
+        {BinOpKind::Sar, "sar"},
+    };
+    return out << map[kind];
+}
+
+std::ostream &operator <<(std::ostream &out, BranchHint hint) {
+    switch (hint) {
+        case BranchHint::Likely:
+        case BranchHint::GuessedLikely:
+            return out << "likely";
+        case BranchHint::Unlikely:
+        case BranchHint::GuessedUnlikely:
+            return out << "unlikely";
+        default:
+            return out;
+    }
+}
+
 std::ostream &operator <<(std::ostream &out, Parameter par) {
     return out << type_to_string(par.type) << " " << par.name;
-}
\ No newline at end of file
+}
+
+/* Tree rewriting */
+size_t tree_size(Node *node) {
+    size_t n = 1;
+    for (Node *child : node->children)
+        n += tree_size(child);
+    return n;
+}
+
+/* Whether every path through the statement ends in a return */
+bool always_returns(Statement *statement) {
+    switch (statement->kind) {
+        case StatementKind::Call:
+            return static_cast<Call *>(statement)->func_name == "return";
+        case StatementKind::Block:
+            return !statement->children.empty()
+                   && always_returns(static_cast<Statement *>(statement->children.back()));
+        case StatementKind::If: {
+            If *i = static_cast<If *>(statement);
+            return i->negative && always_returns(i->positive) && always_returns(i->negative);
+        }
+        case StatementKind::Case: {
+            Case *c = static_cast<Case *>(statement);
+            return c->otherwise && always_returns(c->otherwise)
+                   && std::all_of(c->arms.begin(), c->arms.end(),
+                                  [](CaseArm &arm) { return always_returns(arm.body); });
+        }
+        default:
+            return false;
+    }
+}
+
+Node *copy_node(Node *node) {
+    if (node->kind == NodeKind::Expression) {
+        Expression *expr = static_cast<Expression *>(node);
+        switch (expr->kind) {
+            case ExpressionKind::BinOp:
+                return new BinOp(*static_cast<BinOp *>(expr));
+            case ExpressionKind::UnOp:
+                return new UnOp(*static_cast<UnOp *>(expr));
+            case ExpressionKind::Integer:
+                return new Integer(*static_cast<Integer *>(expr));
+            case ExpressionKind::Boolean:
+                return new Boolean(*static_cast<Boolean *>(expr));
+            case ExpressionKind::Identifier:
+                return new Identifier(*static_cast<Identifier *>(expr));
+            case ExpressionKind::CallExpr:
+                return new CallExpr(*static_cast<CallExpr *>(expr));
+            case ExpressionKind::Index:
+                return new Index(*static_cast<Index *>(expr));
+        }
+    }
+    assert(node->kind == NodeKind::Statement);
+    Statement *statement = static_cast<Statement *>(node);
+    switch (statement->kind) {
+        case StatementKind::Block:
+            return new Block(*static_cast<Block *>(statement));
+        case StatementKind::Variable:
+            return new Variable(*static_cast<Variable *>(statement));
+        case StatementKind::Assignment:
+            return new Assignment(*static_cast<Assignment *>(statement));
+        case StatementKind::While:
+            return new While(*static_cast<While *>(statement));
+        case StatementKind::For:
+            return new For(*static_cast<For *>(statement));
+        case StatementKind::If:
+            return new If(*static_cast<If *>(statement));
+        case StatementKind::Case:
+            return new Case(*static_cast<Case *>(statement));
+        case StatementKind::Call:
+            return new Call(*static_cast<Call *>(statement));
+        case StatementKind::Parallel:
+            return new Parallel(*static_cast<Parallel *>(statement));
+        case StatementKind::Spawn:
+            return new Spawn(*static_cast<Spawn *>(statement));
+        case StatementKind::Sync:
+            return new Sync(*static_cast<Sync *>(statement));
+    }
+    assert(false);
+    return nullptr;
+}
+
+/* Points the fields of a node to its replaced children */
+void remap_children(Node *node, const std::unordered_map<Node *, Node *> &map) {
+    auto update = [&map](auto *&field) {
+        if (field)
+            field = static_cast<std::remove_reference_t<decltype(field)>>(map.at(field));
+    };
+    if (node->kind == NodeKind::Expression) {
+        Expression *expr = static_cast<Expression *>(node);
+        if (expr->kind == ExpressionKind::BinOp) {
+            update(static_cast<BinOp *>(expr)->left);
+            update(static_cast<BinOp *>(expr)->right);
+        } else if (expr->kind == ExpressionKind::UnOp) {
+            update(static_cast<UnOp *>(expr)->arg);
+        } else if (expr->kind == ExpressionKind::CallExpr) {
+            for (Expression *&arg : static_cast<CallExpr *>(expr)->args)
+                update(arg);
+        } else if (expr->kind == ExpressionKind::Index) {
+            update(static_cast<Index *>(expr)->index);
+        }
+        return;
+    }
+
+    Statement *statement = static_cast<Statement *>(node);
+    switch (statement->kind) {
+        case StatementKind::Assignment:
+            update(static_cast<Assignment *>(statement)->expr);
+            break;
+        case StatementKind::While:
+            update(static_cast<While *>(statement)->pred);
+            update(static_cast<While *>(statement)->body);
+            break;
+        case StatementKind::For: {
+            For *f = static_cast<For *>(statement);
+            update(f->var);
+            update(f->from);
+            update(f->to);
+            update(f->step);
+            update(f->body);
+            break;
+        }
+        case StatementKind::If:
+            update(static_cast<If *>(statement)->pred);
+            update(static_cast<If *>(statement)->positive);
+            update(static_cast<If *>(statement)->negative);
+            break;
+        case StatementKind::Case: {
+            Case *c = static_cast<Case *>(statement);
+            update(c->expr);
+            for (CaseArm &arm : c->arms) {
+                for (Expression *&label : arm.labels)
+                    update(label);
+                update(arm.body);
+            }
+            update(c->otherwise);
+            break;
+        }
+        case StatementKind::Call:
+            for (Expression *&arg : static_cast<Call *>(statement)->args)
+                update(arg);
+            break;
+        case StatementKind::Parallel: {
+            Parallel *par = static_cast<Parallel *>(statement);
+            update(par->var);
+            update(par->from);
+            update(par->to);
+            update(par->body);
+            break;
+        }
+        case StatementKind::Spawn:
+            update(static_cast<Spawn *>(statement)->call);
+            break;
+        default:
+            ;
+    }
+}
+
+std::ostream &operator <<(std::ostream &out, const CaseArm &arm) {
+    return out << "case arm with " << arm.labels.size() << " labels";
+}
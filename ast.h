@@ -1,39 +1,124 @@
 #ifndef EPICA_AST_H
 #define EPICA_AST_H
 
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
 #include <vector>
+#include <unordered_map>
 #include <unordered_set>
 #include "location.hh"
 
 enum class Type {
     None,
     Int,
-    Char,
+    Char,  /* 8-bit */
+    Int16,
+    Int32,
     Bool,
     Void,
+    Int4, /* vectors of int, operated on lane-wise */
+    Int8,
 };
 Type type_from_string(const std::string &type);
 std::string type_to_string(Type type);
+unsigned type_lanes(Type type); /* 0 for scalar types */
+unsigned type_bits(Type type);  /* 0 for types other than scalar integers */
+
+/* Compact source location. File names live in a table and locations keep
+   their index, the driver registers every file before parsing it. */
+struct SourceLoc {
+    SourceLoc(const yy::location &loc);
+    operator yy::location() const;
+    static const std::string *add_file(const std::string &name); /* for yy::location::initialize */
+    unsigned begin_line;
+    unsigned short line_span; /* end line - begin line */
+    unsigned short begin_column;
+    unsigned short end_column;
+    unsigned short file; /* 0 if none, else index + 1 */
+};
+std::ostream &operator <<(std::ostream &out, const SourceLoc &loc);
 
 enum class NodeKind {
     Program,
     Function,
+    Const,
     Statement,
     Expression,
 };
+class Node;
+
+/* Children of a node, stored in the node arena next to the nodes. A copy
+   gets storage of its own, growing leaves the old storage to the arena. */
+class NodeList {
+private:
+    Node **items = nullptr;
+    unsigned count = 0;
+    unsigned capacity = 0;
+public:
+    typedef Node *value_type;
+    NodeList() = default;
+    NodeList(const NodeList &other);
+    NodeList &operator =(const NodeList &other);
+    Node **begin() const { return items; }
+    Node **end() const { return items + count; }
+    size_t size() const { return count; }
+    bool empty() const { return !count; }
+    Node *&operator [](size_t i) const { return items[i]; }
+    Node *&back() const { return items[count - 1]; }
+    void reserve(size_t size);
+    void emplace_back(Node *node) {
+        if (count == capacity)
+            reserve(capacity ? 2 * capacity : 2);
+        items[count++] = node;
+    }
+    void push_back(Node *node) { emplace_back(node); }
+    void clear() { *this = NodeList(); }
+    template<class Iterator> void assign(Iterator first, Iterator last) {
+        count = 0;
+        insert(begin(), first, last);
+    }
+    template<class Iterator> void insert(Node **position, Iterator first, Iterator last) {
+        size_t at = position - items, added = std::distance(first, last);
+        reserve(count + added);
+        std::move_backward(items + at, items + count, items + count + added);
+        std::copy(first, last, items + at);
+        count += added;
+    }
+};
+
 class Node {
 public:
     Node(yy::location loc, NodeKind kind);
-    ~Node();
-    yy::location loc;
+    virtual ~Node();
+    SourceLoc loc;
     NodeKind kind;
-    std::vector<Node *> children;
+    NodeList children;
+
+    /* Nodes and their child lists are bump allocated from an arena of the
+       thread creating them, in the order the parser creates them, i.e. in
+       post-order. Deleting a node runs its destructor only; memory is given
+       back by releasing everything the thread allocated since a mark, which
+       the owner of a tree does after deleting it. Nodes may be read from any
+       thread, but must not outlive the thread that created them. */
+    struct ArenaMark {
+        size_t chunks;
+        size_t used;
+        size_t size;
+    };
+    static void *operator new(size_t size);
+    static void operator delete(void *node);
+    static ArenaMark arena_mark();
+    static void arena_release(ArenaMark mark);
 };
 
 class Function;
+class Const;
 class Program : public Node {
 public:
     Program(yy::location loc);
+    ~Program();
+    std::vector<Const *> consts; /* their initializers are among the children */
 };
 
 struct Parameter {
@@ -42,6 +127,12 @@ struct Parameter {
 };
 std::ostream &operator <<(std::ostream &out, Parameter par);
 
+enum class InlineHint {
+    None,
+    Always, /* inline */
+    Never,  /* noinline */
+};
+
 class Variable;
 class Block;
 class Function : public Node {
@@ -52,6 +143,26 @@ public:
     std::vector<Parameter> params;
     Block *body;
     std::vector<Variable *> vars;
+    bool memo;
+    int memo_capacity; /* 0 means unbounded */
+    bool hot;          /* multiversioned for several ISA levels */
+    InlineHint inline_hint;
+    bool reachable;
+    std::vector<Function *> callees;
+};
+
+/* Top-level table of constants with entries from from to to. The
+   initializer is a function of the index, which is evaluated at compile
+   time and not compiled itself. */
+class Const : public Node {
+public:
+    Const(Type type, const std::string &name, long from, long to, Function *init, yy::location loc);
+    Type type;
+    std::string name;
+    long from;
+    long to;
+    Function *init;
+    std::vector<long> values; /* empty until evaluated */
 };
 
 enum class StatementKind {
@@ -59,8 +170,13 @@ enum class StatementKind {
     Variable,
     Assignment,
     While,
+    For,
     If,
+    Case,
     Call,
+    Parallel,
+    Spawn,
+    Sync,
 };
 class Statement : public Node {
 public:
@@ -88,11 +204,35 @@ public:
     Expression *expr;
 };
 
+/* Expected outcome of a branch predicate, either declared or guessed by
+   the semantic analyser */
+enum class BranchHint {
+    None,
+    Likely,   /* likely */
+    Unlikely, /* unlikely */
+    GuessedLikely,
+    GuessedUnlikely,
+};
+std::ostream &operator <<(std::ostream &out, BranchHint hint);
+
 class While : public Statement {
 public:
     While(Expression *pred, Statement *body, yy::location loc);
     Expression *pred;
     Statement *body;
+    BranchHint hint; /* of staying in the loop */
+};
+
+/* Counted loop from from to to inclusive, step is an integer literal or
+   null for 1. The induction variable is private to the loop. */
+class For : public Statement {
+public:
+    For(Variable *var, Expression *from, Expression *to, Expression *step, Statement *body, yy::location loc);
+    Variable *var;
+    Expression *from;
+    Expression *to;
+    Expression *step;
+    Statement *body;
 };
 
 class If : public Statement {
@@ -102,6 +242,35 @@ public:
     Expression *pred;
     Statement *positive;
     Statement *negative;
+    BranchHint hint;
+};
+
+struct CaseArm {
+    std::vector<Expression *> labels; /* integer literals */
+    Statement *body;
+};
+std::ostream &operator <<(std::ostream &out, const CaseArm &arm);
+
+class Case : public Statement {
+public:
+    Case(Expression *expr, std::vector<CaseArm> arms, Statement *otherwise, yy::location loc);
+    Expression *expr;
+    std::vector<CaseArm> arms;
+    Statement *otherwise; /* null if there is no else branch */
+};
+
+enum class BinOpKind;
+class Parallel : public Statement {
+public:
+    Parallel(Variable *var, Expression *from, Expression *to, Statement *body, yy::location loc);
+    Parallel(Variable *var, Expression *from, Expression *to, BinOpKind reduction_kind,
+             const std::string &reduction_var, Statement *body, yy::location loc);
+    Variable *var;
+    Expression *from;
+    Expression *to;
+    BinOpKind reduction_kind;
+    std::string reduction_var; /* empty if there is no reduction */
+    Statement *body;
 };
 
 class Call : public Statement {
@@ -112,6 +281,19 @@ public:
     std::vector<Expression *> args;
 };
 
+class CallExpr;
+class Spawn : public Statement {
+public:
+    Spawn(const std::string &var_name, CallExpr *call, yy::location loc);
+    std::string var_name; /* empty if the result is discarded */
+    CallExpr *call;
+};
+
+class Sync : public Statement {
+public:
+    Sync(yy::location loc);
+};
+
 enum class ExpressionKind {
     BinOp,
     UnOp,
@@ -119,6 +301,7 @@ enum class ExpressionKind {
     Boolean,
     Identifier,
     CallExpr,
+    Index,
 };
 class Expression : public Node {
 public:
@@ -142,8 +325,12 @@ enum class BinOpKind {
     Add,
     Mult,
     Sub,
+    Shl,
+    Shr, /* logical */
+    Sar, /* arithmetic */
 };
 BinOpKind resolve_relation_operator(const std::string &op);
+std::ostream &operator <<(std::ostream &out, BinOpKind kind);
 
 class BinOp : public Expression {
 public:
@@ -191,6 +378,25 @@ public:
     std::vector<Expression *> args;
 };
 
+/* Entry of a constant table, tables are read only by index */
+class Index : public Expression {
+public:
+    Index(const std::string &table_name, Expression *index, yy::location loc);
+    std::string table_name;
+    Expression *index;
+    Const *table;
+};
+
 bool is_builtin(const std::string &name);
+bool is_bit_builtin(const std::string &name);
+bool is_conversion_builtin(const std::string &name);
+bool is_vector_builtin(const std::string &name);
+bool is_exported(const std::string &name);
+
+/* Tree rewriting */
+size_t tree_size(Node *node);
+bool always_returns(Statement *statement);
+Node *copy_node(Node *node); /* shallow, the copy shares the children */
+void remap_children(Node *node, const std::unordered_map<Node *, Node *> &map);
 
 #endif //EPICA_AST_H
@@ -0,0 +1,17 @@
+#include <stdio.h>
+
+int main()
+{
+  long n, i, x = 1, small = 0, large = 0, negative = 0;
+  scanf("%ld", &n);
+  for (i = 0; i < n; i++) {
+    x = (long)((unsigned long)x * 1103515245 + 12345);
+    if (x < 0)
+      negative++;
+    else if ((x & 1048576) == 0)
+      small = (long)((unsigned long)small + i);
+    else
+      large ^= x;
+  }
+  printf("%ld\n%ld\n%ld\n", negative, small, large);
+}
@@ -0,0 +1,15 @@
+#include <stdio.h>
+
+long fib(long n)
+{
+  if (n < 2)
+    return n;
+  return fib(n - 1) + fib(n - 2);
+}
+
+int main()
+{
+  long n;
+  scanf("%ld", &n);
+  printf("%ld\n", fib(n));
+}
@@ -0,0 +1,12 @@
+#include <stdio.h>
+
+int main()
+{
+  long n, i, x, sum = 0;
+  scanf("%ld", &n);
+  for (i = 0; i < n; i++) {
+    scanf("%ld", &x);
+    sum += x;
+    printf("%ld\n", sum);
+  }
+}
@@ -0,0 +1,12 @@
+#include <stdio.h>
+
+int main()
+{
+  long n, i, x = 1, sum = 0;
+  scanf("%ld", &n);
+  for (i = 0; i < n; i++) {
+    x = (long)((unsigned long)x * 1103515245 + 12345);
+    sum = (long)((unsigned long)sum + (x ^ i));
+  }
+  printf("%ld\n", sum);
+}
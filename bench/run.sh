@@ -0,0 +1,125 @@
+#!/bin/bash
+# Runtime benchmarks of generated code against C baselines.
+#
+# Usage: bench/run.sh [--update]
+#
+# Every kernel in bench/ is built through epica-driver at each optimization
+# level and its C counterpart with gcc -O2. Reported are the best of
+# EPICA_BENCH_RUNS wall clock times as a ratio to C, retired instructions
+# (when perf is available) and binary size. Ratios are compared with
+# bench/baseline.txt and regressions beyond EPICA_BENCH_TOLERANCE percent
+# make the script fail; --update rewrites the baseline instead.
+#
+# Ratios only carry over between runs on the same CPU with the same gcc and
+# LLVM, so no baseline is checked in: the first run records bench/baseline.txt
+# for this machine, starting with the CPU, the compilers and the commit it was
+# recorded with. A baseline from another machine or toolchain is not compared
+# against; --update records a new one.
+set -e
+cd "$(dirname "$0")/.."
+
+runs=${EPICA_BENCH_RUNS:-3}
+tolerance=${EPICA_BENCH_TOLERANCE:-15}
+levels="0 1 2 3"
+baseline=bench/baseline.txt
+workdir=$(mktemp -d -t epica-benchXXXXXXXXX)
+trap 'rm -r $workdir' EXIT
+
+# Where the ratios come from, the commit only for reference
+provenance() {
+    echo "# cpu: $(awk -F': ' '/^model name/ { print $2; exit }' /proc/cpuinfo)"
+    echo "# gcc: $(gcc -dumpfullversion)"
+    echo "# epica: $(./epica --version | awk '{ print $NF }')"
+    echo "# opt/llc: $(llc --version | awk '/LLVM version/ { print $NF; exit }')"
+}
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+update=
+if [ "$1" == "--update" ] || [ ! -f $baseline ]; then
+    update=1
+elif [ "$(grep -v '^# commit:' $baseline | grep '^#')" != "$(provenance)" ]; then
+    echo "$baseline was recorded on another machine or with other compilers:"
+    grep '^#' $baseline || echo "# (no provenance recorded)"
+    echo "not comparing, bench/run.sh --update records a baseline for this one"
+    baseline=/dev/null
+fi
+
+# Input of each kernel
+declare -A inputs=(
+    [loop]="300000000"
+    [branch]="100000000"
+    [fib]="40"
+    [io]="$workdir/io.in"
+)
+{ echo 2000000; seq 1 2000000; } > $workdir/io.in
+
+input() {
+    if [ -f "${inputs[$1]}" ]; then cat "${inputs[$1]}"; else echo "${inputs[$1]}"; fi
+}
+
+# Best wall clock time in seconds of running binary $1 on the input of $2
+measure() {
+    local best=""
+    for _ in $(seq $runs); do
+        local start=$(date +%s%N)
+        input $2 | $1 > /dev/null
+        local time=$(( $(date +%s%N) - start ))
+        if [ -z "$best" ] || [ $time -lt $best ]; then best=$time; fi
+    done
+    awk -v t=$best 'BEGIN { printf "%.4f", t / 1e9 }'
+}
+
+instructions() {
+    if command -v perf > /dev/null; then
+        input $2 | perf stat -x, -e instructions $1 2>&1 > /dev/null | awk -F, '/instructions/ { print $1 }'
+    else
+        echo "-"
+    fi
+}
+
+results=$workdir/results.txt
+status=0
+printf "%-10s %-6s %10s %8s %14s %10s\n" kernel level time ratio instructions size
+for source in bench/*.epica; do
+    kernel=$(basename $source .epica)
+
+    gcc -O2 bench/$kernel.c -o $workdir/$kernel.c.bin
+    expected=$(input $kernel | $workdir/$kernel.c.bin | md5sum)
+    c_time=$(measure $workdir/$kernel.c.bin $kernel)
+    printf "%-10s %-6s %10s %8s %14s %10s\n" $kernel gcc-O2 $c_time 1.00 \
+        "$(instructions $workdir/$kernel.c.bin $kernel)" $(stat -c %s $workdir/$kernel.c.bin)
+
+    for level in $levels; do
+        cp $source $workdir/$kernel.epica
+        ./epica-driver -O$level $workdir/$kernel.epica
+        binary=$workdir/$kernel.O$level
+        mv $workdir/$kernel $binary
+        if [ "$(input $kernel | $binary | md5sum)" != "$expected" ]; then
+            echo "$kernel -O$level: output differs from the C version"
+            status=1
+            continue
+        fi
+
+        time=$(measure $binary $kernel)
+        ratio=$(awk -v t=$time -v c=$c_time 'BEGIN { printf "%.2f", t / c }')
+        printf "%-10s %-6s %10s %8s %14s %10s\n" $kernel -O$level $time $ratio \
+            "$(instructions $binary $kernel)" $(stat -c %s $binary)
+        echo "$kernel -O$level $ratio" >> $results
+
+        previous=""
+        if [ -z "$update" ]; then
+            previous=$(awk -v k=$kernel -v l=-O$level '$1 == k && $2 == l { print $3 }' $baseline)
+        fi
+        if [ -n "$previous" ] \
+           && awk -v r=$ratio -v p=$previous -v t=$tolerance 'BEGIN { exit !(r > p * (100 + t) / 100) }'; then
+            echo "$kernel -O$level: regression, ratio $ratio (baseline $previous)"
+            status=1
+        fi
+    done
+done
+
+if [ -n "$update" ]; then
+    { provenance; echo "# commit: $commit"; cat $results; } > $baseline
+    echo "baseline written to $baseline"
+fi
+exit $status
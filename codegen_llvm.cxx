@@ -1,11 +1,86 @@
 #include <algorithm>
 #include <cassert>
+#include <format>
+#include <iostream>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/CodeGen/UnreachableBlockElim.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/MC/TargetRegistry.h>
 #include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/TargetParser/Host.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ModuleUtils.h>
 #include "codegen_llvm.h"
 #include "ast.h"
 
-CodegenLLVM::CodegenLLVM(Program *program) : program(program) {}
+CodegenLLVM::CodegenLLVM(Program *program, bool instrument)
+    : program(program), context(std::make_unique<llvm::LLVMContext>()), ctx(*context), instrument(instrument), current_prof_id(0), multiversion(false),
+      separate_modules(false) {}
+
+std::unique_ptr<llvm::LLVMContext> CodegenLLVM::take_context() {
+    return std::move(context);
+}
+
+bool CodegenLLVM::set_target(const std::string &triple, const std::string &cpu, const std::string &features,
+                             bool multiversion) {
+    llvm::InitializeAllTargetInfos();
+    llvm::InitializeAllTargets();
+    llvm::InitializeAllTargetMCs();
+    llvm::InitializeAllAsmPrinters();
+
+    std::string target_triple = triple.empty() ? llvm::sys::getDefaultTargetTriple() : triple;
+    std::string error;
+    const llvm::Target *target = llvm::TargetRegistry::lookupTarget(target_triple, error);
+    if (!target) {
+        std::cerr << "target: " << error << std::endl;
+        return false;
+    }
+
+    /* Note: native features only make sense together with the native cpu */
+    std::string target_cpu = cpu == "native" ? llvm::sys::getHostCPUName().str() : cpu;
+    std::string target_features = features;
+    if (features == "native" || (cpu == "native" && features.empty())) {
+        llvm::StringMap<bool> host_features;
+        target_features.clear();
+        if (llvm::sys::getHostCPUFeatures(host_features)) {
+            for (auto &feature : host_features) {
+                if (!target_features.empty())
+                    target_features += ",";
+                target_features += (feature.getValue() ? "+" : "-") + feature.getKey().str();
+            }
+        }
+    }
+
+    /* Versions are dispatched by an ifunc resolver, which is an ELF feature */
+    llvm::Triple parsed(target_triple);
+    if (multiversion && (!parsed.isX86() || !parsed.isOSBinFormatELF())) {
+        std::cerr << "target: multiversioning is only supported on x86 ELF targets" << std::endl;
+        return false;
+    }
+
+    target_machine.reset(target->createTargetMachine(target_triple,
+                                                     target_cpu,
+                                                     target_features,
+                                                     llvm::TargetOptions(),
+                                                     llvm::Reloc::PIC_));
+    if (!target_machine) {
+        std::cerr << "target: cannot create target machine for " << target_triple << std::endl;
+        return false;
+    }
+    this->multiversion = multiversion;
+    return true;
+}
+
+void CodegenLLVM::set_target(std::shared_ptr<llvm::TargetMachine> machine, bool multiversion) {
+    target_machine = std::move(machine);
+    this->multiversion = multiversion;
+}
+
+std::shared_ptr<llvm::TargetMachine> CodegenLLVM::get_target() {
+    return target_machine;
+}
 
 llvm::Type *CodegenLLVM::get_type(Type t) {
     switch (t) {
@@ -15,6 +90,15 @@ llvm::Type *CodegenLLVM::get_type(Type t) {
             return llvm::Type::getInt1Ty(ctx);
         case Type::Int:
             return llvm::Type::getInt64Ty(ctx);
+        case Type::Char:
+            return llvm::Type::getInt8Ty(ctx);
+        case Type::Int16:
+            return llvm::Type::getInt16Ty(ctx);
+        case Type::Int32:
+            return llvm::Type::getInt32Ty(ctx);
+        case Type::Int4:
+        case Type::Int8:
+            return llvm::FixedVectorType::get(get_type(Type::Int), type_lanes(t));
         default:
             assert(false);
     }
@@ -27,19 +111,11 @@ llvm::FunctionType *CodegenLLVM::get_function_type(Function *fun) {
     return llvm::FunctionType::get(get_type(fun->type), param_types, 0);
 }
 
-llvm::Module *CodegenLLVM::compile() {
+void CodegenLLVM::create_module() {
     mod = new llvm::Module("program", ctx);
-
-    /* Create all function prototypes */
-    for (Node *child : program->children) {
-        assert(child->kind == NodeKind::Function);
-        Function *fun = static_cast<Function *>(child);
-        llvm::Function::Create(get_function_type(fun),
-                               fun->name[0] == 'x' || fun->name == "main"
-                                    ? llvm::Function::ExternalLinkage
-                                    : llvm::Function::InternalLinkage,
-                               fun->name,
-                               mod);
+    if (target_machine) {
+        mod->setTargetTriple(target_machine->getTargetTriple().str());
+        mod->setDataLayout(target_machine->createDataLayout());
     }
 
     /* Create prototypes for builtins */
@@ -53,50 +129,746 @@ llvm::Module *CodegenLLVM::compile() {
                            llvm::Function::ExternalLinkage,
                            "write",
                            mod);
+}
+
+/* Functions other than the exported ones get a prefix that no identifier
+   has, so that they never clash with the runtime or with libc (free, exit,
+   memcpy, ...), neither in the module nor when linking */
+std::string CodegenLLVM::symbol_name(Function *fun) {
+    return is_exported(fun->name) ? fun->name : "epica." + fun->name;
+}
+
+llvm::Function *CodegenLLVM::declare_function(Function *fun) {
+    /* With a module per function, everything has to be visible to the
+       other modules, but not outside of the program */
+    llvm::Function *func = llvm::Function::Create(get_function_type(fun),
+                                                  is_exported(fun->name) || separate_modules
+                                                      ? llvm::Function::ExternalLinkage
+                                                      : llvm::Function::InternalLinkage,
+                                                  symbol_name(fun),
+                                                  mod);
+    if (separate_modules && !is_exported(fun->name))
+        func->setVisibility(llvm::GlobalValue::HiddenVisibility);
+    if (fun->inline_hint == InlineHint::Always)
+        func->addFnAttr(llvm::Attribute::AlwaysInline);
+    else if (fun->inline_hint == InlineHint::Never)
+        func->addFnAttr(llvm::Attribute::NoInline);
+    return func;
+}
+
+llvm::Function *CodegenLLVM::get_function(Function *fun) {
+    llvm::Function *func = mod->getFunction(symbol_name(fun));
+    return func ? func : declare_function(fun);
+}
+
+void CodegenLLVM::define_function(Function *fun) {
+    declare_function(fun);
+
+    /* Memo functions get their body emitted separately, the exported
+       symbol becomes a wrapper that consults the result cache */
+    if (fun->memo) {
+        llvm::Function::Create(get_function_type(fun),
+                               llvm::Function::InternalLinkage,
+                               symbol_name(fun) + ".memo",
+                               mod);
+        new llvm::GlobalVariable(*mod,
+                                 llvm::PointerType::get(ctx, 0),
+                                 false,
+                                 llvm::GlobalVariable::InternalLinkage,
+                                 llvm::ConstantPointerNull::get(llvm::PointerType::get(ctx, 0)),
+                                 symbol_name(fun) + ".memo.table");
+    }
+}
+
+/* Tables are read-only and internal, so they end up in .rodata and loads
+   at known indices fold away */
+llvm::GlobalVariable *CodegenLLVM::define_const(Const *constant) {
+    llvm::Type *type = get_type(constant->type);
+    std::vector<llvm::Constant *> entries;
+    for (long value : constant->values)
+        entries.emplace_back(llvm::ConstantInt::get(type, value, constant->type != Type::Bool));
+    llvm::ArrayType *table_type = llvm::ArrayType::get(type, entries.size());
+    llvm::GlobalVariable *table = new llvm::GlobalVariable(*mod,
+                                                           table_type,
+                                                           true,
+                                                           llvm::GlobalVariable::InternalLinkage,
+                                                           llvm::ConstantArray::get(table_type, entries),
+                                                           constant->name + ".const");
+    table->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+    return table;
+}
+
+/* A module per function gets a copy of the tables it reads */
+llvm::GlobalVariable *CodegenLLVM::get_const(Const *constant) {
+    llvm::GlobalVariable *table = mod->getNamedGlobal(constant->name + ".const");
+    return table ? table : define_const(constant);
+}
+
+void CodegenLLVM::emit_function(Function *fun) {
+    current_func = mod->getFunction(symbol_name(fun) + (fun->memo ? ".memo" : ""));
+    current_bb = llvm::BasicBlock::Create(ctx, "entry", current_func);
+    current_vars.clear();
+    current_frame = nullptr;
+
+    /* Create local variables for arguments.
+       Note: this is necessary, since you can assign new values to them */
+    int i = 0;
+    for (Parameter param : fun->params) {
+        llvm::AllocaInst *arg = new llvm::AllocaInst(get_type(param.type),
+                                                     0,
+                                                     param.name,
+                                                     current_bb);
+        new llvm::StoreInst(current_func->getArg(i), arg, current_bb);
+        current_vars.insert({param.name, arg});
+        i++;
+    }
+    /* Note: for memo functions only cache misses get here */
+    if (instrument)
+        emit_prof_enter(fun->name);
+
+    /* Emit code for body */
+    emit(static_cast<Node *>(fun->body));
+
+    /* Add default return value */
+    if (current_frame)
+        emit_sync();
+    if (instrument)
+        emit_prof_exit();
+    if (fun->type == Type::Void)
+        llvm::ReturnInst::Create(ctx, current_bb);
+    else
+        llvm::ReturnInst::Create(ctx,
+                                 llvm::ConstantInt::get(get_type(fun->type), 0),
+                                 current_bb);
+
+    /* Cleanup */
+    llvm::FunctionPassManager fpm;
+    llvm::FunctionAnalysisManager fam;
+    llvm::PassBuilder pb;
+    pb.registerFunctionAnalyses(fam);
+    fpm.addPass(llvm::UnreachableBlockElimPass());
+    fpm.run(*current_func, fam);
+
+    if (fun->memo)
+        emit_memo_wrapper(fun);
+}
+
+void CodegenLLVM::set_target_attributes() {
+    /* opt and llc pick the cpu and its features up from function attributes */
+    if (!target_machine)
+        return;
+    for (llvm::Function &func : *mod) {
+        if (func.isDeclaration())
+            continue;
+        if (!target_machine->getTargetCPU().empty())
+            func.addFnAttr("target-cpu", target_machine->getTargetCPU());
+        if (!target_machine->getTargetFeatureString().empty())
+            func.addFnAttr("target-features", target_machine->getTargetFeatureString());
+    }
+}
+
+llvm::Module *CodegenLLVM::compile() {
+    create_module();
+
+    for (Const *constant : program->consts)
+        define_const(constant);
+
+    /* Create all function prototypes */
+    for (Node *child : program->children) {
+        assert(child->kind == NodeKind::Function);
+        Function *fun = static_cast<Function *>(child);
+        if (fun->reachable)
+            define_function(fun);
+    }
 
     /* Emit code for all functions */
     for (Node *child : program->children) {
         Function *fun = static_cast<Function *>(child);
-        current_func = mod->getFunction(fun->name);
-        current_bb = llvm::BasicBlock::Create(ctx, "entry", current_func);
-        current_vars.clear();
-
-        /* Create local variables for arguments.
-           Note: this is necessary, since you can assign new values to them */
-        int i = 0;
-        for (Parameter param : fun->params) {
-            llvm::AllocaInst *arg = new llvm::AllocaInst(get_type(param.type),
-                                                         0,
-                                                         param.name,
-                                                         current_bb);
-            new llvm::StoreInst(current_func->getArg(i), arg, current_bb);
-            current_vars.insert({param.name, arg});
-            i++;
-        }
+        if (fun->reachable)
+            emit_function(fun);
+    }
 
-        /* Emit code for body */
-        emit(static_cast<Node *>(fun->body));
+    if (instrument)
+        emit_prof_init();
 
-        /* Add default return value */
-        if (fun->type == Type::Void)
-            llvm::ReturnInst::Create(ctx, current_bb);
-        else
-            llvm::ReturnInst::Create(ctx,
-                                     llvm::ConstantInt::get(get_type(fun->type), 0),
-                                     current_bb);
-
-        /* Cleanup */
-        llvm::FunctionPassManager fpm;
-        llvm::FunctionAnalysisManager fam;
-        llvm::PassBuilder pb;
-        pb.registerFunctionAnalyses(fam);
-        fpm.addPass(llvm::UnreachableBlockElimPass());
-        fpm.run(*current_func, fam);
+    set_target_attributes();
+    if (multiversion) {
+        for (Node *child : program->children) {
+            Function *fun = static_cast<Function *>(child);
+            if (fun->hot && fun->reachable)
+                emit_multiversion(fun);
+        }
     }
 
     return mod;
 }
 
+llvm::Module *CodegenLLVM::compile_function(Function *fun) {
+    separate_modules = true;
+    create_module();
+    define_function(fun);
+    emit_function(fun);
+    set_target_attributes();
+    if (multiversion && fun->hot)
+        emit_multiversion(fun);
+    return mod;
+}
+
+/* Module of only the call thunk of a function, which is declared, so that
+   the interpreter can call the function compiled in a module of its own */
+llvm::Module *CodegenLLVM::compile_call_thunk(Function *fun) {
+    separate_modules = true;
+    create_module();
+    get_call_thunk(fun)->setLinkage(llvm::GlobalValue::ExternalLinkage);
+    set_target_attributes();
+    return mod;
+}
+
+/* Number of words a variable takes in the environment of a parallel body */
+static unsigned env_words(llvm::Type *type) {
+    return type->isVectorTy() ? llvm::cast<llvm::FixedVectorType>(type)->getNumElements() : 1;
+}
+
+llvm::Function *CodegenLLVM::emit_parallel_body(Parallel *par, const std::vector<std::string> &captured) {
+    llvm::Type *int_type = get_type(Type::Int);
+    llvm::Type *ptr_type = llvm::PointerType::get(ctx, 0);
+    llvm::Function *parent_func = current_func;
+    llvm::BasicBlock *parent_bb = current_bb;
+    llvm::AllocaInst *parent_frame = current_frame;
+    auto parent_vars = current_vars;
+    long parent_prof_id = current_prof_id;
+    auto parent_prof_loops = std::move(current_prof_loops);
+
+    /* Outlined body: long body(long *env, long first, long last), running
+       iterations first to last inclusive and returning their partial reduction.
+       The runtime never passes an empty chunk. */
+    current_func = llvm::Function::Create(llvm::FunctionType::get(int_type, {ptr_type, int_type, int_type}, 0),
+                                          llvm::Function::InternalLinkage,
+                                          parent_func->getName() + ".parallel",
+                                          mod);
+    current_bb = llvm::BasicBlock::Create(ctx, "entry", current_func);
+    current_vars.clear();
+    current_frame = nullptr;
+
+    for (unsigned i = 0, offset = 0; i < captured.size(); i++) {
+        llvm::Type *type = parent_vars[captured[i]]->getAllocatedType();
+        llvm::AllocaInst *var = new llvm::AllocaInst(type, 0, captured[i], current_bb);
+        llvm::Value *value;
+        if (captured[i] == par->reduction_var) {
+            /* Each chunk starts from the identity of the reduction */
+            value = llvm::ConstantInt::get(int_type,
+                                           par->reduction_kind == BinOpKind::Mult ? 1
+                                           : par->reduction_kind == BinOpKind::And ? -1 : 0);
+        } else {
+            llvm::Value *slot = llvm::GetElementPtrInst::Create(int_type,
+                                                                current_func->getArg(0),
+                                                                {llvm::ConstantInt::get(int_type, offset)},
+                                                                "",
+                                                                current_bb);
+            value = new llvm::LoadInst(type->isVectorTy() ? type : int_type,
+                                       slot,
+                                       "",
+                                       false,
+                                       llvm::Align(8),
+                                       current_bb);
+            if (value->getType() != type)
+                value = new llvm::TruncInst(value, type, "", current_bb);
+        }
+        new llvm::StoreInst(value, var, current_bb);
+        current_vars.insert({captured[i], var});
+        offset += env_words(type);
+    }
+    /* Every chunk counts as a call of the body */
+    current_prof_loops.clear();
+    if (instrument)
+        emit_prof_enter(current_func->getName().str());
+    emit(static_cast<Node *>(par->var));
+    llvm::AllocaInst *induction = current_vars[par->var->name];
+    new llvm::StoreInst(current_func->getArg(1), induction, current_bb);
+
+    /* Exits after the last iteration, before stepping, so that the
+       induction variable never overflows */
+    llvm::BasicBlock *loop = llvm::BasicBlock::Create(ctx, "parallel.loop", current_func);
+    llvm::BasicBlock *latch = llvm::BasicBlock::Create(ctx, "parallel.latch", current_func);
+    llvm::BasicBlock *next = llvm::BasicBlock::Create(ctx, "parallel.next", current_func);
+    llvm::BranchInst::Create(loop, current_bb);
+
+    current_bb = loop;
+    emit(static_cast<Node *>(par->body));
+    llvm::Value *value = new llvm::LoadInst(int_type, induction, par->var->name, current_bb);
+    llvm::Value *pred = llvm::CmpInst::Create(llvm::Instruction::OtherOps::ICmp,
+                                              llvm::CmpInst::Predicate::ICMP_EQ,
+                                              value,
+                                              current_func->getArg(2),
+                                              "",
+                                              current_bb);
+    llvm::BranchInst::Create(next, latch, pred, current_bb);
+
+    llvm::Value *step = llvm::BinaryOperator::Create(llvm::BinaryOperator::Add,
+                                                     value,
+                                                     llvm::ConstantInt::get(int_type, 1),
+                                                     "",
+                                                     latch);
+    new llvm::StoreInst(step, induction, latch);
+    llvm::BranchInst::Create(loop, latch);
+
+    current_bb = next;
+    if (instrument)
+        emit_prof_exit();
+    if (par->reduction_var.empty())
+        llvm::ReturnInst::Create(ctx, llvm::ConstantInt::get(int_type, 0), next);
+    else
+        llvm::ReturnInst::Create(ctx,
+                                 new llvm::LoadInst(int_type, current_vars[par->reduction_var], "", next),
+                                 next);
+
+    llvm::Function *body = current_func;
+    current_func = parent_func;
+    current_bb = parent_bb;
+    current_frame = parent_frame;
+    current_vars = parent_vars;
+    current_prof_id = parent_prof_id;
+    current_prof_loops = std::move(parent_prof_loops);
+    return body;
+}
+
+/* Code that has to run on any x86-64 cpu. An empty feature string has to
+   be given, as a missing one means the features of the target machine,
+   e.g. those of the host with --cpu=native. */
+static void set_baseline_target(llvm::Function *func) {
+    func->addFnAttr("target-cpu", "x86-64");
+    func->addFnAttr("target-features", "");
+}
+
+void CodegenLLVM::emit_multiversion(Function *fun) {
+    /* Note: ISA levels must match epica_cpu_level in libepica */
+    static const char *levels[] = {"x86-64-v2", "x86-64-v3", "x86-64-v4"};
+    llvm::Function *base = mod->getFunction(symbol_name(fun) + (fun->memo ? ".memo" : ""));
+    std::string name = base->getName().str();
+
+    std::vector<llvm::Function *> versions;
+    for (const char *level : levels) {
+        llvm::ValueToValueMapTy vmap;
+        llvm::Function *version = llvm::CloneFunction(base, vmap);
+        version->setName(name + "." + level);
+        version->setLinkage(llvm::Function::InternalLinkage);
+        version->addFnAttr("target-cpu", level);
+        version->addFnAttr("target-features", "");
+        /* Recursive calls stay within the version */
+        for (llvm::BasicBlock &bb : *version) {
+            for (llvm::Instruction &inst : bb)
+                inst.replaceUsesOfWith(base, version);
+        }
+        versions.emplace_back(version);
+    }
+
+    /* All other callers go through an ifunc, resolved once at load time */
+    llvm::Type *ptr_type = llvm::PointerType::get(ctx, 0);
+    llvm::Function *resolver = llvm::Function::Create(llvm::FunctionType::get(ptr_type, {}, 0),
+                                                      llvm::Function::InternalLinkage,
+                                                      name + ".resolver",
+                                                      mod);
+    llvm::GlobalIFunc *ifunc = llvm::GlobalIFunc::create(base->getFunctionType(),
+                                                         0,
+                                                         base->getLinkage(),
+                                                         "",
+                                                         resolver,
+                                                         mod);
+    base->replaceAllUsesWith(ifunc);
+    ifunc->takeName(base);
+    base->setName(name + ".default");
+    base->setLinkage(llvm::Function::InternalLinkage);
+    /* The fallback and the dispatch run on cpus older than the target */
+    set_baseline_target(base);
+    set_baseline_target(resolver);
+
+    llvm::Type *int_type = get_type(Type::Int);
+    llvm::FunctionCallee cpu_level = mod->getOrInsertFunction("epica_cpu_level",
+                                                              llvm::FunctionType::get(int_type, {}, 0));
+    llvm::BasicBlock *entry = llvm::BasicBlock::Create(ctx, "entry", resolver);
+    llvm::Value *level = llvm::CallInst::Create(cpu_level, {}, "", entry);
+    llvm::Value *chosen = base;
+    for (unsigned i = 0; i < versions.size(); i++) {
+        llvm::Value *supported = llvm::CmpInst::Create(llvm::Instruction::OtherOps::ICmp,
+                                                       llvm::CmpInst::Predicate::ICMP_SGE,
+                                                       level,
+                                                       llvm::ConstantInt::get(int_type, i + 2),
+                                                       "",
+                                                       entry);
+        chosen = llvm::SelectInst::Create(supported, versions[i], chosen, "", entry);
+    }
+    llvm::ReturnInst::Create(ctx, chosen, entry);
+}
+
+llvm::Function *CodegenLLVM::get_call_thunk(Function *fun) {
+    llvm::Function *thunk = mod->getFunction(symbol_name(fun) + ".thunk");
+    if (thunk)
+        return thunk;
+
+    /* void thunk(long *args, void *result) calls the function with the
+       arguments passed as an array and stores its result, if requested.
+       Used for spawned calls and calls from the interpreter. */
+    llvm::Type *int_type = get_type(Type::Int);
+    llvm::Type *ptr_type = llvm::PointerType::get(ctx, 0);
+    thunk = llvm::Function::Create(llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), {ptr_type, ptr_type}, 0),
+                                   llvm::Function::InternalLinkage,
+                                   symbol_name(fun) + ".thunk",
+                                   mod);
+    llvm::BasicBlock *entry = llvm::BasicBlock::Create(ctx, "entry", thunk);
+    std::vector<llvm::Value *> args;
+    for (unsigned i = 0; i < fun->params.size(); i++) {
+        llvm::Value *slot = llvm::GetElementPtrInst::Create(int_type,
+                                                            thunk->getArg(0),
+                                                            {llvm::ConstantInt::get(int_type, i)},
+                                                            "",
+                                                            entry);
+        llvm::Value *arg = new llvm::LoadInst(int_type, slot, "", entry);
+        if (get_type(fun->params[i].type) != int_type)
+            arg = new llvm::TruncInst(arg, get_type(fun->params[i].type), "", entry);
+        args.emplace_back(arg);
+    }
+    llvm::Value *result = llvm::CallInst::Create(get_function_type(fun), get_function(fun), args, "", entry);
+    if (fun->type == Type::Void) {
+        llvm::ReturnInst::Create(ctx, entry);
+        return thunk;
+    }
+
+    llvm::BasicBlock *store = llvm::BasicBlock::Create(ctx, "store", thunk);
+    llvm::BasicBlock *done = llvm::BasicBlock::Create(ctx, "done", thunk);
+    llvm::Value *wanted = llvm::CmpInst::Create(llvm::Instruction::OtherOps::ICmp,
+                                                llvm::CmpInst::Predicate::ICMP_NE,
+                                                thunk->getArg(1),
+                                                llvm::ConstantPointerNull::get(llvm::PointerType::get(ctx, 0)),
+                                                "",
+                                                entry);
+    llvm::BranchInst::Create(store, done, wanted, entry);
+    new llvm::StoreInst(result, thunk->getArg(1), store);
+    llvm::BranchInst::Create(done, store);
+    llvm::ReturnInst::Create(ctx, done);
+    return thunk;
+}
+
+void CodegenLLVM::emit_sync() {
+    llvm::FunctionCallee sync = mod->getOrInsertFunction(
+            "epica_sync",
+            llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), {llvm::PointerType::get(ctx, 0)}, 0));
+    llvm::CallInst::Create(sync, {current_frame}, "", current_bb);
+}
+
+void CodegenLLVM::emit_prof_enter(const std::string &name) {
+    current_prof_id = prof_funcs.size();
+    prof_funcs.emplace_back(name);
+    llvm::FunctionCallee enter = mod->getOrInsertFunction(
+            "epica_prof_enter",
+            llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), {get_type(Type::Int)}, 0));
+    llvm::CallInst::Create(enter, {llvm::ConstantInt::get(get_type(Type::Int), current_prof_id)}, "", current_bb);
+}
+
+void CodegenLLVM::emit_prof_exit() {
+    llvm::Type *int_type = get_type(Type::Int);
+    llvm::FunctionCallee loop = mod->getOrInsertFunction(
+            "epica_prof_loop",
+            llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), {int_type, int_type}, 0));
+    llvm::FunctionCallee exit = mod->getOrInsertFunction(
+            "epica_prof_exit",
+            llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), {int_type}, 0));
+
+    /* Loops left by the return would not report their trips otherwise */
+    for (auto &[id, trips] : current_prof_loops) {
+        llvm::CallInst::Create(loop,
+                               {llvm::ConstantInt::get(int_type, id),
+                                new llvm::LoadInst(int_type, trips, "", current_bb)},
+                               "",
+                               current_bb);
+    }
+    llvm::CallInst::Create(exit, {llvm::ConstantInt::get(int_type, current_prof_id)}, "", current_bb);
+}
+
+/* Trips are counted locally and reported once the loop is left */
+llvm::AllocaInst *CodegenLLVM::emit_prof_loop_enter(unsigned line) {
+    llvm::Type *int_type = get_type(Type::Int);
+    llvm::AllocaInst *trips = create_entry_alloca(int_type, nullptr, "loop.trips");
+    new llvm::StoreInst(llvm::ConstantInt::get(int_type, 0), trips, current_bb);
+    current_prof_loops.emplace_back(prof_loops.size(), trips);
+    prof_loops.emplace_back(std::format("{}:{}", prof_funcs[current_prof_id], line));
+    return trips;
+}
+
+void CodegenLLVM::emit_prof_loop_trip(llvm::AllocaInst *trips) {
+    llvm::Type *int_type = get_type(Type::Int);
+    llvm::Value *count = llvm::BinaryOperator::Create(llvm::BinaryOperator::Add,
+                                                      new llvm::LoadInst(int_type, trips, "", current_bb),
+                                                      llvm::ConstantInt::get(int_type, 1),
+                                                      "",
+                                                      current_bb);
+    new llvm::StoreInst(count, trips, current_bb);
+}
+
+void CodegenLLVM::emit_prof_loop_exit() {
+    llvm::Type *int_type = get_type(Type::Int);
+    auto [id, trips] = current_prof_loops.back();
+    current_prof_loops.pop_back();
+    llvm::FunctionCallee report = mod->getOrInsertFunction(
+            "epica_prof_loop",
+            llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), {int_type, int_type}, 0));
+    llvm::CallInst::Create(report,
+                           {llvm::ConstantInt::get(int_type, id),
+                            new llvm::LoadInst(int_type, trips, "", current_bb)},
+                           "",
+                           current_bb);
+}
+
+llvm::Constant *CodegenLLVM::create_name_table(const std::vector<std::string> &names, const std::string &name) {
+    llvm::Type *ptr_type = llvm::PointerType::get(ctx, 0);
+    std::vector<llvm::Constant *> strings;
+    for (const std::string &s : names) {
+        strings.emplace_back(new llvm::GlobalVariable(*mod,
+                                                      llvm::ArrayType::get(llvm::Type::getInt8Ty(ctx), s.size() + 1),
+                                                      true,
+                                                      llvm::GlobalVariable::PrivateLinkage,
+                                                      llvm::ConstantDataArray::getString(ctx, s),
+                                                      name + ".name"));
+    }
+    llvm::ArrayType *table_type = llvm::ArrayType::get(ptr_type, strings.size());
+    return new llvm::GlobalVariable(*mod,
+                                    table_type,
+                                    true,
+                                    llvm::GlobalVariable::PrivateLinkage,
+                                    llvm::ConstantArray::get(table_type, strings),
+                                    name);
+}
+
+void CodegenLLVM::emit_prof_init() {
+    /* A constructor hands the names of all instrumented functions and
+       loops to the runtime, ids are indices into these tables */
+    llvm::Type *int_type = get_type(Type::Int);
+    llvm::Type *ptr_type = llvm::PointerType::get(ctx, 0);
+    llvm::FunctionCallee init = mod->getOrInsertFunction(
+            "epica_prof_init",
+            llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), {ptr_type, int_type, ptr_type, int_type}, 0));
+    llvm::Function *ctor = llvm::Function::Create(llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), {}, 0),
+                                                  llvm::Function::InternalLinkage,
+                                                  "epica.prof.init",
+                                                  mod);
+    llvm::BasicBlock *entry = llvm::BasicBlock::Create(ctx, "entry", ctor);
+    llvm::CallInst::Create(init,
+                           {create_name_table(prof_funcs, "epica.prof.funcs"),
+                            llvm::ConstantInt::get(int_type, prof_funcs.size()),
+                            create_name_table(prof_loops, "epica.prof.loops"),
+                            llvm::ConstantInt::get(int_type, prof_loops.size())},
+                           "",
+                           entry);
+    llvm::ReturnInst::Create(ctx, entry);
+    llvm::appendToGlobalCtors(*mod, ctor, 0);
+}
+
+llvm::AllocaInst *CodegenLLVM::create_entry_alloca(llvm::Type *type, llvm::Value *size, const std::string &name) {
+    /* Allocas outside of the entry block would grow the stack in loops */
+    llvm::BasicBlock &entry = current_func->getEntryBlock();
+    if (entry.empty())
+        return new llvm::AllocaInst(type, 0, size, name, &entry);
+    return new llvm::AllocaInst(type, 0, size, name, &entry.front());
+}
+
+void CodegenLLVM::emit_memo_wrapper(Function *fun) {
+    llvm::Type *int_type = get_type(Type::Int);
+    llvm::Type *ptr_type = llvm::PointerType::get(ctx, 0);
+    llvm::FunctionCallee lookup = mod->getOrInsertFunction(
+            "epica_memo_lookup",
+            llvm::FunctionType::get(llvm::Type::getInt32Ty(ctx),
+                                    {ptr_type, int_type, int_type, ptr_type, ptr_type},
+                                    0));
+    llvm::FunctionCallee store = mod->getOrInsertFunction(
+            "epica_memo_store",
+            llvm::FunctionType::get(llvm::Type::getVoidTy(ctx),
+                                    {ptr_type, int_type, int_type, ptr_type, int_type},
+                                    0));
+
+    llvm::Function *wrapper = mod->getFunction(symbol_name(fun));
+    llvm::Function *body = mod->getFunction(symbol_name(fun) + ".memo");
+    llvm::Value *table = mod->getNamedGlobal(symbol_name(fun) + ".memo.table");
+    llvm::Value *arity = llvm::ConstantInt::get(int_type, fun->params.size());
+    llvm::Value *capacity = llvm::ConstantInt::get(int_type, fun->memo_capacity);
+
+    /* Pack all arguments into an array of ints, which serves as the key */
+    llvm::BasicBlock *entry = llvm::BasicBlock::Create(ctx, "entry", wrapper);
+    llvm::AllocaInst *key = new llvm::AllocaInst(int_type, 0, arity, "memo.key", entry);
+    llvm::AllocaInst *result = new llvm::AllocaInst(int_type, 0, "memo.result", entry);
+    std::vector<llvm::Value *> args;
+    for (unsigned i = 0; i < fun->params.size(); i++) {
+        llvm::Value *arg = wrapper->getArg(i);
+        args.emplace_back(arg);
+        if (arg->getType() != int_type)
+            arg = new llvm::ZExtInst(arg, int_type, "", entry);
+        llvm::Value *slot = llvm::GetElementPtrInst::Create(int_type,
+                                                            key,
+                                                            {llvm::ConstantInt::get(int_type, i)},
+                                                            "",
+                                                            entry);
+        new llvm::StoreInst(arg, slot, entry);
+    }
+    llvm::Value *found = llvm::CallInst::Create(lookup, {table, arity, capacity, key, result}, "", entry);
+    llvm::Value *hit_pred = llvm::CmpInst::Create(llvm::Instruction::OtherOps::ICmp,
+                                                  llvm::CmpInst::Predicate::ICMP_NE,
+                                                  found,
+                                                  llvm::ConstantInt::get(found->getType(), 0),
+                                                  "",
+                                                  entry);
+    llvm::BasicBlock *hit = llvm::BasicBlock::Create(ctx, "memo.hit", wrapper);
+    llvm::BasicBlock *miss = llvm::BasicBlock::Create(ctx, "memo.miss", wrapper);
+    llvm::BranchInst::Create(hit, miss, hit_pred, entry);
+
+    /* Cached result */
+    llvm::Value *cached = new llvm::LoadInst(int_type, result, "", hit);
+    if (get_type(fun->type) != int_type)
+        cached = new llvm::TruncInst(cached, get_type(fun->type), "", hit);
+    llvm::ReturnInst::Create(ctx, cached, hit);
+
+    /* Compute and remember the result */
+    llvm::Value *computed = llvm::CallInst::Create(body, args, "", miss);
+    llvm::Value *computed_int = computed;
+    if (computed->getType() != int_type)
+        computed_int = new llvm::ZExtInst(computed, int_type, "", miss);
+    llvm::CallInst::Create(store, {table, arity, capacity, key, computed_int}, "", miss);
+    llvm::ReturnInst::Create(ctx, computed, miss);
+}
+
+/* Integers are sign extended or truncated, bools are zero extended */
+llvm::Value *CodegenLLVM::emit_convert(llvm::Value *value, llvm::Type *type) {
+    if (value->getType() == type)
+        return value;
+    return llvm::CastInst::CreateIntegerCast(value, type, !value->getType()->isIntegerTy(1), "", current_bb);
+}
+
+/* Declared outcomes are weighted like llvm.expect, guessed ones less
+   strongly so that a wrong guess costs little */
+void CodegenLLVM::set_branch_weights(llvm::BranchInst *branch, BranchHint hint) {
+    static const uint32_t declared_weight = 2000;
+    static const uint32_t guessed_weight = 16;
+    llvm::MDBuilder md(ctx);
+    switch (hint) {
+        case BranchHint::Likely:
+            branch->setMetadata(llvm::LLVMContext::MD_prof, md.createBranchWeights(declared_weight, 1));
+            break;
+        case BranchHint::Unlikely:
+            branch->setMetadata(llvm::LLVMContext::MD_prof, md.createBranchWeights(1, declared_weight));
+            break;
+        case BranchHint::GuessedLikely:
+            branch->setMetadata(llvm::LLVMContext::MD_prof, md.createBranchWeights(guessed_weight, 1));
+            break;
+        case BranchHint::GuessedUnlikely:
+            branch->setMetadata(llvm::LLVMContext::MD_prof, md.createBranchWeights(1, guessed_weight));
+            break;
+        default:
+            break;
+    }
+}
+
+/* Broadcasts an integer value to all lanes of a vector of the given type */
+llvm::Value *CodegenLLVM::emit_splat(llvm::Value *value, Type type) {
+    if (value->getType()->isVectorTy())
+        return value;
+    value = emit_convert(value, get_type(Type::Int));
+    llvm::Value *vector = llvm::InsertElementInst::Create(llvm::PoisonValue::get(get_type(type)),
+                                                          value,
+                                                          llvm::ConstantInt::get(get_type(Type::Int), 0),
+                                                          "",
+                                                          current_bb);
+    return new llvm::ShuffleVectorInst(vector, std::vector<int>(type_lanes(type), 0), "", current_bb);
+}
+
+void CodegenLLVM::emit_bit_builtin(CallExpr *call, std::vector<llvm::Value *> &args) {
+    const std::string &name = call->func_name;
+    for (llvm::Value *&arg : args)
+        arg = type_lanes(call->type) ? emit_splat(arg, call->type) : emit_convert(arg, get_type(call->type));
+
+    llvm::Intrinsic::ID id;
+    if (name == "popcount") {
+        id = llvm::Intrinsic::ctpop;
+    } else if (name == "clz" || name == "ctz") {
+        /* Defined for 0 as the bit width */
+        id = name == "clz" ? llvm::Intrinsic::ctlz : llvm::Intrinsic::cttz;
+        args.emplace_back(llvm::ConstantInt::getFalse(ctx));
+    } else if (name == "bswap") {
+        id = llvm::Intrinsic::bswap;
+    } else {
+        /* Rotation is a funnel shift of the value with itself */
+        id = name == "rotl" ? llvm::Intrinsic::fshl : llvm::Intrinsic::fshr;
+        args = {args[0], args[0], args[1]};
+    }
+    current_value = llvm::CallInst::Create(llvm::Intrinsic::getDeclaration(mod, id, {get_type(call->type)}),
+                                           args,
+                                           "",
+                                           current_bb);
+}
+
+void CodegenLLVM::emit_vector_builtin(CallExpr *call, std::vector<llvm::Value *> &args) {
+    llvm::Type *int_type = get_type(Type::Int);
+    const std::string &name = call->func_name;
+
+    if (name == "splat4" || name == "splat8") {
+        current_value = emit_splat(args[0], call->type);
+    } else if (name == "vector") {
+        current_value = llvm::PoisonValue::get(get_type(call->type));
+        for (unsigned i = 0; i < args.size(); i++)
+            current_value = llvm::InsertElementInst::Create(current_value,
+                                                            args[i],
+                                                            llvm::ConstantInt::get(int_type, i),
+                                                            "",
+                                                            current_bb);
+    } else if (name == "lane" || name == "insert") {
+        /* Lane indices wrap around, so that they are never out of range */
+        unsigned lanes = type_lanes(call->args[0]->type);
+        llvm::Value *index = llvm::BinaryOperator::Create(llvm::BinaryOperator::And,
+                                                          args[1],
+                                                          llvm::ConstantInt::get(int_type, lanes - 1),
+                                                          "",
+                                                          current_bb);
+        if (name == "lane")
+            current_value = llvm::ExtractElementInst::Create(args[0], index, "", current_bb);
+        else
+            current_value = llvm::InsertElementInst::Create(args[0], args[2], index, "", current_bb);
+    } else if (name == "shuffle") {
+        std::vector<int> mask;
+        for (size_t i = 1; i < call->args.size(); i++)
+            mask.emplace_back(static_cast<Integer *>(call->args[i])->value);
+        current_value = new llvm::ShuffleVectorInst(args[0], mask, "", current_bb);
+    } else {
+        /* Masks select lanes which are not zero */
+        llvm::Value *zero = llvm::ConstantInt::get(args[0]->getType(), 0);
+        llvm::Intrinsic::ID reduction;
+        if (name == "select" || name == "any" || name == "all") {
+            llvm::Value *pred = llvm::CmpInst::Create(llvm::Instruction::OtherOps::ICmp,
+                                                      llvm::CmpInst::Predicate::ICMP_NE,
+                                                      args[0],
+                                                      zero,
+                                                      "",
+                                                      current_bb);
+            if (name == "select") {
+                current_value = llvm::SelectInst::Create(pred, args[1], args[2], "", current_bb);
+                return;
+            }
+            args[0] = pred;
+            reduction = name == "any" ? llvm::Intrinsic::vector_reduce_or : llvm::Intrinsic::vector_reduce_and;
+        } else {
+            static const std::unordered_map<std::string, llvm::Intrinsic::ID> reductions = {
+                {"reduce_add", llvm::Intrinsic::vector_reduce_add},
+                {"reduce_mul", llvm::Intrinsic::vector_reduce_mul},
+                {"reduce_and", llvm::Intrinsic::vector_reduce_and},
+                {"reduce_or", llvm::Intrinsic::vector_reduce_or},
+                {"reduce_xor", llvm::Intrinsic::vector_reduce_xor},
+                {"reduce_min", llvm::Intrinsic::vector_reduce_smin},
+                {"reduce_max", llvm::Intrinsic::vector_reduce_smax},
+            };
+            reduction = reductions.at(name);
+        }
+        current_value = llvm::CallInst::Create(llvm::Intrinsic::getDeclaration(mod, reduction, {args[0]->getType()}),
+                                               {args[0]},
+                                               "",
+                                               current_bb);
+    }
+}
+
 void CodegenLLVM::emit(Node *node) {
     switch (node->kind) {
         case NodeKind::Expression: {
@@ -115,9 +887,25 @@ void CodegenLLVM::emit(Node *node) {
                                                                args,
                                                                "",
                                                                current_bb);
+                    } else if (call->func_name == "read_char") {
+                        /* Note: the runtime passes chars as longs, -1 at end of input */
+                        llvm::FunctionCallee read_char = mod->getOrInsertFunction(
+                                "epica_read_char",
+                                llvm::FunctionType::get(get_type(Type::Int), {}, 0));
+                        current_value = emit_convert(llvm::CallInst::Create(read_char, {}, "", current_bb),
+                                                     get_type(Type::Char));
+                    } else if (is_conversion_builtin(call->func_name)) {
+                        current_value = emit_convert(args[0], get_type(call->type));
+                    } else if (is_bit_builtin(call->func_name)) {
+                        emit_bit_builtin(call, args);
+                    } else if (is_vector_builtin(call->func_name)) {
+                        emit_vector_builtin(call, args);
                     } else {
-                        current_value = llvm::CallInst::Create(get_function_type(call->func),
-                                                               mod->getFunction(call->func_name),
+                        llvm::FunctionType *func_type = get_function_type(call->func);
+                        for (unsigned i = 0; i < args.size(); i++)
+                            args[i] = emit_convert(args[i], func_type->getParamType(i));
+                        current_value = llvm::CallInst::Create(func_type,
+                                                               get_function(call->func),
                                                                args,
                                                                "",
                                                                current_bb);
@@ -130,6 +918,19 @@ void CodegenLLVM::emit(Node *node) {
                     auto left_value = current_value;
                     emit(static_cast<Node *>(binop->right));
                     auto right_value = current_value;
+                    /* Lane-wise operation, integer operands are broadcast */
+                    Type vector_type = type_lanes(binop->left->type) ? binop->left->type : binop->right->type;
+                    if (type_lanes(vector_type)) {
+                        left_value = emit_splat(left_value, vector_type);
+                        right_value = emit_splat(right_value, vector_type);
+                    } else if (left_value->getType() != right_value->getType()) {
+                        /* The narrower integer operand is widened */
+                        llvm::Type *type = left_value->getType()->getIntegerBitWidth()
+                                           > right_value->getType()->getIntegerBitWidth()
+                                           ? left_value->getType() : right_value->getType();
+                        left_value = emit_convert(left_value, type);
+                        right_value = emit_convert(right_value, type);
+                    }
 
                     llvm::BinaryOperator::BinaryOps int_kind;
                     llvm::CmpInst::Predicate bool_kind;
@@ -156,6 +957,24 @@ void CodegenLLVM::emit(Node *node) {
                         case BinOpKind::LogXor:
                             int_kind = llvm::BinaryOperator::Xor;
                             goto binint;
+                        case BinOpKind::Shl:
+                            int_kind = llvm::BinaryOperator::Shl;
+                            goto binshift;
+                        case BinOpKind::Shr:
+                            int_kind = llvm::BinaryOperator::LShr;
+                            goto binshift;
+                        case BinOpKind::Sar:
+                            int_kind = llvm::BinaryOperator::AShr;
+                            goto binshift;
+                        binshift:
+                            /* Shift amounts are taken modulo the bit width like on x86, instead of
+                               giving poison */
+                            right_value = llvm::BinaryOperator::Create(llvm::BinaryOperator::And,
+                                                                       right_value,
+                                                                       llvm::ConstantInt::get(right_value->getType(),
+                                                                                              right_value->getType()->getScalarSizeInBits() - 1),
+                                                                       "",
+                                                                       current_bb);
                         binint:
                             current_value = llvm::BinaryOperator::Create(int_kind,
                                                                      left_value,
@@ -185,6 +1004,12 @@ void CodegenLLVM::emit(Node *node) {
                                                                   right_value,
                                                                   "",
                                                                   current_bb);
+                            /* Vector masks have all bits of true lanes set */
+                            if (type_lanes(binop->type))
+                                current_value = new llvm::SExtInst(current_value,
+                                                                   get_type(binop->type),
+                                                                   "",
+                                                                   current_bb);
                             break;
                     }
                     break;
@@ -206,7 +1031,7 @@ void CodegenLLVM::emit(Node *node) {
                 }
                 case ExpressionKind::Integer: {
                     Integer *integer = static_cast<Integer *>(expression);
-                    current_value = llvm::ConstantInt::get(get_type(Type::Int), integer->value);
+                    current_value = llvm::ConstantInt::get(get_type(integer->type), integer->value, true);
                     break;
                 }
                 case ExpressionKind::Boolean: {
@@ -223,6 +1048,43 @@ void CodegenLLVM::emit(Node *node) {
                                                        current_bb);
                     break;
                 }
+                case ExpressionKind::Index: {
+                    /* Entries out of range read zero, the load itself uses
+                       an index clamped into the table */
+                    Index *index = static_cast<Index *>(expression);
+                    Const *table = index->table;
+                    llvm::Type *int_type = get_type(Type::Int);
+                    emit(static_cast<Node *>(index->index));
+                    llvm::Value *offset = llvm::BinaryOperator::Create(llvm::BinaryOperator::Sub,
+                                                                       emit_convert(current_value, int_type),
+                                                                       llvm::ConstantInt::get(int_type, table->from),
+                                                                       "",
+                                                                       current_bb);
+                    llvm::Value *in_range = llvm::CmpInst::Create(llvm::Instruction::OtherOps::ICmp,
+                                                                  llvm::CmpInst::Predicate::ICMP_ULT,
+                                                                  offset,
+                                                                  llvm::ConstantInt::get(int_type,
+                                                                                         table->values.size()),
+                                                                  "",
+                                                                  current_bb);
+                    llvm::Value *clamped = llvm::SelectInst::Create(in_range,
+                                                                    offset,
+                                                                    llvm::ConstantInt::get(int_type, 0),
+                                                                    "",
+                                                                    current_bb);
+                    llvm::Value *slot = llvm::GetElementPtrInst::Create(get_type(index->type),
+                                                                        get_const(table),
+                                                                        {clamped},
+                                                                        "",
+                                                                        current_bb);
+                    llvm::Value *entry = new llvm::LoadInst(get_type(index->type), slot, table->name, current_bb);
+                    current_value = llvm::SelectInst::Create(in_range,
+                                                             entry,
+                                                             llvm::ConstantInt::get(get_type(index->type), 0),
+                                                             "",
+                                                             current_bb);
+                    break;
+                }
             }
             break;
         }
@@ -237,22 +1099,37 @@ void CodegenLLVM::emit(Node *node) {
                         args.emplace_back(current_value);
                     }
                     if (call->func_name == "return") {
+                        /* Spawned tasks may still write to this frame */
+                        if (current_frame)
+                            emit_sync();
+                        if (instrument)
+                            emit_prof_exit();
                         if (args.empty())
                             llvm::ReturnInst::Create(ctx, current_bb);
                         else
-                            llvm::ReturnInst::Create(ctx, args[0], current_bb);
+                            llvm::ReturnInst::Create(ctx,
+                                                     emit_convert(args[0], current_func->getReturnType()),
+                                                     current_bb);
                         current_bb = llvm::BasicBlock::Create(ctx, "unreach", current_func);
+                    } else if (call->func_name == "write" && call->args[0]->type == Type::Char) {
+                        llvm::FunctionCallee write_char = mod->getOrInsertFunction(
+                                "epica_write_char",
+                                llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), {get_type(Type::Int)}, 0));
+                        llvm::CallInst::Create(write_char, {emit_convert(args[0], get_type(Type::Int))}, "", current_bb);
                     } else if (call->func_name == "write") {
                         llvm::CallInst::Create(llvm::FunctionType::get(llvm::Type::getVoidTy(ctx),
                                                                        {llvm::Type::getInt64Ty(ctx)},
                                                                        0),
                                                mod->getFunction(call->func_name),
-                                               args,
+                                               {emit_convert(args[0], get_type(Type::Int))},
                                                "",
                                                current_bb);
                     } else {
-                        llvm::CallInst::Create(get_function_type(call->func),
-                                               mod->getFunction(call->func_name),
+                        llvm::FunctionType *func_type = get_function_type(call->func);
+                        for (unsigned i = 0; i < args.size(); i++)
+                            args[i] = emit_convert(args[i], func_type->getParamType(i));
+                        llvm::CallInst::Create(func_type,
+                                               get_function(call->func),
                                                args,
                                                "",
                                                current_bb);
@@ -263,15 +1140,16 @@ void CodegenLLVM::emit(Node *node) {
                     Assignment *assignment = static_cast<Assignment *>(statement);
                     emit(assignment->expr);
                     llvm::AllocaInst *var = current_vars[assignment->var_name];
-                    current_value = new llvm::StoreInst(current_value, var, current_bb);
+                    current_value = new llvm::StoreInst(emit_convert(current_value, var->getAllocatedType()),
+                                                        var,
+                                                        current_bb);
                     break;
                 }
                 case StatementKind::Variable: {
+                    /* Variables are function-scoped, and inlined bodies may
+                       declare them inside loops */
                     Variable *variable = static_cast<Variable *>(statement);
-                    llvm::AllocaInst *var = new llvm::AllocaInst(get_type(variable->type),
-                                                                 0,
-                                                                 variable->name,
-                                                                 current_bb);
+                    llvm::AllocaInst *var = create_entry_alloca(get_type(variable->type), nullptr, variable->name);
                     current_vars.insert({variable->name, var});
                     break;
                 }
@@ -289,10 +1167,11 @@ void CodegenLLVM::emit(Node *node) {
                     llvm::BasicBlock *false_branch = llvm::BasicBlock::Create(ctx, "if.false", current_func);
                     llvm::BasicBlock *join_branch = llvm::BasicBlock::Create(ctx, "if.join", current_func);
 
-                    llvm::BranchInst::Create(true_branch,
-                                             i->negative ? false_branch : join_branch,
-                                             pred_value,
-                                             current_bb);
+                    llvm::BranchInst *branch = llvm::BranchInst::Create(true_branch,
+                                                                        i->negative ? false_branch : join_branch,
+                                                                        pred_value,
+                                                                        current_bb);
+                    set_branch_weights(branch, i->hint);
                     current_bb = true_branch;
                     emit(static_cast<Node *>(i->positive));
                     llvm::BranchInst::Create(join_branch, current_bb);
@@ -305,17 +1184,283 @@ void CodegenLLVM::emit(Node *node) {
 
                     break;
                 }
+                case StatementKind::Case: {
+                    /* A switch lets the backend pick jump tables, bit tests or a
+                       search tree instead of a chain of comparisons */
+                    Case *c = static_cast<Case *>(statement);
+                    emit(static_cast<Node *>(c->expr));
+                    llvm::Value *selector = current_value;
+                    llvm::BasicBlock *join_branch = llvm::BasicBlock::Create(ctx, "case.join", current_func);
+                    llvm::BasicBlock *else_branch = c->otherwise
+                                                    ? llvm::BasicBlock::Create(ctx, "case.else", current_func)
+                                                    : join_branch;
+                    llvm::SwitchInst *switch_inst = llvm::SwitchInst::Create(selector,
+                                                                             else_branch,
+                                                                             c->arms.size(),
+                                                                             current_bb);
+                    for (CaseArm &arm : c->arms) {
+                        llvm::BasicBlock *arm_branch = llvm::BasicBlock::Create(ctx, "case.arm", current_func);
+                        for (Expression *label : arm.labels) {
+                            switch_inst->addCase(llvm::ConstantInt::get(llvm::cast<llvm::IntegerType>(selector->getType()),
+                                                                        static_cast<Integer *>(label)->value,
+                                                                        true),
+                                                 arm_branch);
+                        }
+                        current_bb = arm_branch;
+                        emit(static_cast<Node *>(arm.body));
+                        llvm::BranchInst::Create(join_branch, current_bb);
+                    }
+                    if (c->otherwise) {
+                        current_bb = else_branch;
+                        emit(static_cast<Node *>(c->otherwise));
+                        llvm::BranchInst::Create(join_branch, current_bb);
+                    }
+                    current_bb = join_branch;
+                    break;
+                }
+                case StatementKind::Parallel: {
+                    Parallel *par = static_cast<Parallel *>(statement);
+                    llvm::Type *int_type = get_type(Type::Int);
+                    llvm::Type *ptr_type = llvm::PointerType::get(ctx, 0);
+                    emit(static_cast<Node *>(par->from));
+                    llvm::Value *from = emit_convert(current_value, int_type);
+                    /* The runtime takes the last iteration, to + 1 would overflow at LONG_MAX */
+                    emit(static_cast<Node *>(par->to));
+                    llvm::Value *to = emit_convert(current_value, int_type);
+
+                    /* Pass the current values of all visible variables to the body,
+                       vectors take a word per lane */
+                    std::vector<std::string> captured;
+                    unsigned env_size = 0;
+                    for (auto &[name, var] : current_vars) {
+                        captured.emplace_back(name);
+                        env_size += env_words(var->getAllocatedType());
+                    }
+                    llvm::AllocaInst *env = new llvm::AllocaInst(int_type,
+                                                                 0,
+                                                                 llvm::ConstantInt::get(int_type, env_size),
+                                                                 "parallel.env",
+                                                                 current_bb);
+                    for (unsigned i = 0, offset = 0; i < captured.size(); i++) {
+                        llvm::AllocaInst *var = current_vars[captured[i]];
+                        llvm::Value *value = new llvm::LoadInst(var->getAllocatedType(), var, "", current_bb);
+                        if (value->getType() != int_type && !value->getType()->isVectorTy())
+                            value = new llvm::ZExtInst(value, int_type, "", current_bb);
+                        llvm::Value *slot = llvm::GetElementPtrInst::Create(int_type,
+                                                                            env,
+                                                                            {llvm::ConstantInt::get(int_type, offset)},
+                                                                            "",
+                                                                            current_bb);
+                        new llvm::StoreInst(value, slot, false, llvm::Align(8), current_bb);
+                        offset += env_words(var->getAllocatedType());
+                    }
+
+                    llvm::Function *body = emit_parallel_body(par, captured);
+
+                    /* Note: reduction operator codes match libepica */
+                    int op = 0;
+                    llvm::BinaryOperator::BinaryOps int_kind = llvm::BinaryOperator::Add;
+                    if (!par->reduction_var.empty()) {
+                        switch (par->reduction_kind) {
+                            case BinOpKind::Add:
+                                op = 1;
+                                int_kind = llvm::BinaryOperator::Add;
+                                break;
+                            case BinOpKind::Mult:
+                                op = 2;
+                                int_kind = llvm::BinaryOperator::Mul;
+                                break;
+                            case BinOpKind::And:
+                                op = 3;
+                                int_kind = llvm::BinaryOperator::And;
+                                break;
+                            case BinOpKind::Or:
+                                op = 4;
+                                int_kind = llvm::BinaryOperator::Or;
+                                break;
+                            default:
+                                assert(false);
+                        }
+                    }
+                    llvm::FunctionCallee parallel_for = mod->getOrInsertFunction(
+                            "epica_parallel_for",
+                            llvm::FunctionType::get(int_type,
+                                                    {int_type, int_type, ptr_type, ptr_type, int_type},
+                                                    0));
+                    current_value = llvm::CallInst::Create(parallel_for,
+                                                           {from, to, body, env, llvm::ConstantInt::get(int_type, op)},
+                                                           "",
+                                                           current_bb);
+
+                    /* Combine partial results with the value from before the loop */
+                    if (!par->reduction_var.empty()) {
+                        llvm::AllocaInst *var = current_vars[par->reduction_var];
+                        llvm::Value *initial = new llvm::LoadInst(int_type, var, par->reduction_var, current_bb);
+                        current_value = llvm::BinaryOperator::Create(int_kind,
+                                                                     initial,
+                                                                     current_value,
+                                                                     "",
+                                                                     current_bb);
+                        new llvm::StoreInst(current_value, var, current_bb);
+                    }
+                    break;
+                }
+                case StatementKind::Spawn: {
+                    Spawn *spawn = static_cast<Spawn *>(statement);
+                    llvm::Type *int_type = get_type(Type::Int);
+                    llvm::Type *ptr_type = llvm::PointerType::get(ctx, 0);
+                    llvm::FunctionType *func_type = get_function_type(spawn->call->func);
+                    std::vector<llvm::Value *> args;
+                    for (unsigned i = 0; i < spawn->call->args.size(); i++) {
+                        emit(static_cast<Node *>(spawn->call->args[i]));
+                        args.emplace_back(emit_convert(current_value, func_type->getParamType(i)));
+                    }
+
+                    /* Note: frame and task sizes in words must match struct
+                       epica_frame and struct epica_task in libepica */
+                    if (!current_frame) {
+                        current_frame = create_entry_alloca(int_type, nullptr, "spawn.frame");
+                        if (current_frame->getNextNode())
+                            new llvm::StoreInst(llvm::ConstantInt::get(int_type, 0),
+                                                current_frame,
+                                                current_frame->getNextNode());
+                        else
+                            new llvm::StoreInst(llvm::ConstantInt::get(int_type, 0),
+                                                current_frame,
+                                                current_frame->getParent());
+                    }
+                    llvm::AllocaInst *task = create_entry_alloca(int_type,
+                                                                 llvm::ConstantInt::get(int_type, 5),
+                                                                 "spawn.task");
+                    llvm::AllocaInst *data = create_entry_alloca(int_type,
+                                                                 llvm::ConstantInt::get(int_type,
+                                                                                        std::max<size_t>(args.size(), 1)),
+                                                                 "spawn.data");
+                    for (unsigned i = 0; i < args.size(); i++) {
+                        llvm::Value *arg = args[i];
+                        if (arg->getType() != int_type)
+                            arg = new llvm::ZExtInst(arg, int_type, "", current_bb);
+                        llvm::Value *slot = llvm::GetElementPtrInst::Create(int_type,
+                                                                            data,
+                                                                            {llvm::ConstantInt::get(int_type, i)},
+                                                                            "",
+                                                                            current_bb);
+                        new llvm::StoreInst(arg, slot, current_bb);
+                    }
+
+                    llvm::Value *result = spawn->var_name.empty()
+                                          ? static_cast<llvm::Value *>(llvm::ConstantPointerNull::get(
+                                                  llvm::PointerType::get(ctx, 0)))
+                                          : current_vars[spawn->var_name];
+                    llvm::FunctionCallee spawn_func = mod->getOrInsertFunction(
+                            "epica_spawn",
+                            llvm::FunctionType::get(llvm::Type::getVoidTy(ctx),
+                                                    {ptr_type, ptr_type, ptr_type, ptr_type, ptr_type},
+                                                    0));
+                    llvm::CallInst::Create(spawn_func,
+                                           {current_frame, task, get_call_thunk(spawn->call->func), data, result},
+                                           "",
+                                           current_bb);
+                    break;
+                }
+                case StatementKind::Sync: {
+                    if (current_frame)
+                        emit_sync();
+                    break;
+                }
                 case StatementKind::While: {
                     While *wh = static_cast<While *>(statement);
+                    llvm::AllocaInst *trips = instrument ? emit_prof_loop_enter(wh->loc.begin_line) : nullptr;
                     llvm::BasicBlock *loop = llvm::BasicBlock::Create(ctx, "while.loop", current_func);
                     llvm::BranchInst::Create(loop, current_bb);
                     current_bb = loop;
+                    if (instrument)
+                        emit_prof_loop_trip(trips);
                     emit(static_cast<Node *>(wh->body));
                     emit(static_cast<Node *>(wh->pred));
                     llvm::Value *pred = current_value;
                     llvm::BasicBlock *next = llvm::BasicBlock::Create(ctx, "while.next", current_func);
-                    llvm::BranchInst::Create(loop, next, pred, current_bb);
+                    set_branch_weights(llvm::BranchInst::Create(loop, next, pred, current_bb), wh->hint);
+                    current_bb = next;
+                    if (instrument)
+                        emit_prof_loop_exit();
+                    break;
+                }
+                case StatementKind::For: {
+                    For *f = static_cast<For *>(statement);
+                    llvm::Type *int_type = get_type(Type::Int);
+                    long step = f->step ? static_cast<Integer *>(f->step)->value : 1;
+                    emit(static_cast<Node *>(f->from));
+                    llvm::Value *from = emit_convert(current_value, int_type);
+                    emit(static_cast<Node *>(f->to));
+                    llvm::Value *to = emit_convert(current_value, int_type);
+                    llvm::AllocaInst *trips = instrument ? emit_prof_loop_enter(f->loc.begin_line) : nullptr;
+
+                    /* Canonical loop: guarded, with the last value of the
+                       induction variable computed in the preheader and the
+                       induction variable itself a phi incremented with nsw,
+                       so that scalar evolution knows the trip count */
+                    llvm::BasicBlock *preheader = llvm::BasicBlock::Create(ctx, "for.preheader", current_func);
+                    llvm::BasicBlock *loop = llvm::BasicBlock::Create(ctx, "for.loop", current_func);
+                    llvm::BasicBlock *next = llvm::BasicBlock::Create(ctx, "for.next", current_func);
+                    llvm::Value *enter = llvm::CmpInst::Create(llvm::Instruction::OtherOps::ICmp,
+                                                               step > 0 ? llvm::CmpInst::Predicate::ICMP_SLE
+                                                                        : llvm::CmpInst::Predicate::ICMP_SGE,
+                                                               from,
+                                                               to,
+                                                               "",
+                                                               current_bb);
+                    llvm::BranchInst::Create(preheader, next, enter, current_bb);
+
+                    /* last = from + (|to - from| / |step|) * step, which cannot overflow */
+                    current_bb = preheader;
+                    llvm::Value *distance = llvm::BinaryOperator::Create(llvm::BinaryOperator::Sub,
+                                                                         step > 0 ? to : from,
+                                                                         step > 0 ? from : to,
+                                                                         "",
+                                                                         current_bb);
+                    llvm::Value *count = llvm::BinaryOperator::Create(llvm::BinaryOperator::UDiv,
+                                                                      distance,
+                                                                      llvm::ConstantInt::get(int_type, std::abs(step)),
+                                                                      "",
+                                                                      current_bb);
+                    llvm::Value *last = llvm::BinaryOperator::Create(
+                            llvm::BinaryOperator::Add,
+                            from,
+                            llvm::BinaryOperator::Create(llvm::BinaryOperator::Mul,
+                                                         count,
+                                                         llvm::ConstantInt::get(int_type, step),
+                                                         "",
+                                                         current_bb),
+                            "for.last",
+                            current_bb);
+                    llvm::BranchInst::Create(loop, current_bb);
+
+                    current_bb = loop;
+                    llvm::PHINode *induction = llvm::PHINode::Create(int_type, 2, f->var->name, current_bb);
+                    induction->addIncoming(from, preheader);
+                    llvm::AllocaInst *var = create_entry_alloca(int_type, nullptr, f->var->name);
+                    current_vars[f->var->name] = var;
+                    new llvm::StoreInst(induction, var, current_bb);
+                    if (instrument)
+                        emit_prof_loop_trip(trips);
+                    emit(static_cast<Node *>(f->body));
+                    llvm::Value *increment = llvm::BinaryOperator::CreateNSWAdd(induction,
+                                                                                llvm::ConstantInt::get(int_type, step),
+                                                                                "",
+                                                                                current_bb);
+                    induction->addIncoming(increment, current_bb);
+                    llvm::Value *more = llvm::CmpInst::Create(llvm::Instruction::OtherOps::ICmp,
+                                                              llvm::CmpInst::Predicate::ICMP_NE,
+                                                              induction,
+                                                              last,
+                                                              "",
+                                                              current_bb);
+                    llvm::BranchInst::Create(loop, next, more, current_bb);
                     current_bb = next;
+                    current_vars.erase(f->var->name);
+                    if (instrument)
+                        emit_prof_loop_exit();
                     break;
                 }
             }
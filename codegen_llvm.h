@@ -1,27 +1,75 @@
 #ifndef EPICA_CODEGEN_LLVM_H
 #define EPICA_CODEGEN_LLVM_H
 
+#include <memory>
 #include <unordered_map>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/Target/TargetMachine.h>
 #include "ast.h"
 
 class CodegenLLVM {
 private:
     Program *program;
-    llvm::LLVMContext ctx;
+    std::unique_ptr<llvm::LLVMContext> context;
+    llvm::LLVMContext &ctx;
     llvm::Module *mod;
 
     llvm::Function *current_func;
     llvm::BasicBlock *current_bb;
     llvm::Value *current_value;
     std::unordered_map<std::string, llvm::AllocaInst *> current_vars;
+    llvm::AllocaInst *current_frame;
 
+    /* Profiling instrumentation, see --instrument */
+    bool instrument;
+    std::vector<std::string> prof_funcs;
+    std::vector<std::string> prof_loops;
+    long current_prof_id;
+    std::vector<std::pair<long, llvm::AllocaInst *>> current_prof_loops;
+
+    std::shared_ptr<llvm::TargetMachine> target_machine;
+    bool multiversion;
+    bool separate_modules;
+
+    void create_module();
+    llvm::Function *declare_function(Function *fun);
+    llvm::Function *get_function(Function *fun);
+    void define_function(Function *fun);
+    void emit_function(Function *fun);
+    void set_target_attributes();
     void emit(Node *node);
+    llvm::Value *emit_convert(llvm::Value *value, llvm::Type *type);
+    llvm::Value *emit_splat(llvm::Value *value, Type type);
+    void set_branch_weights(llvm::BranchInst *branch, BranchHint hint);
+    void emit_bit_builtin(CallExpr *call, std::vector<llvm::Value *> &args);
+    void emit_vector_builtin(CallExpr *call, std::vector<llvm::Value *> &args);
+    void emit_memo_wrapper(Function *fun);
+    llvm::GlobalVariable *define_const(Const *constant);
+    llvm::GlobalVariable *get_const(Const *constant);
+    llvm::Function *emit_parallel_body(Parallel *par, const std::vector<std::string> &captured);
+    void emit_sync();
+    void emit_prof_enter(const std::string &name);
+    void emit_prof_exit();
+    llvm::AllocaInst *emit_prof_loop_enter(unsigned line);
+    void emit_prof_loop_trip(llvm::AllocaInst *trips);
+    void emit_prof_loop_exit();
+    void emit_prof_init();
+    void emit_multiversion(Function *fun);
+    llvm::Constant *create_name_table(const std::vector<std::string> &names, const std::string &name);
+    llvm::AllocaInst *create_entry_alloca(llvm::Type *type, llvm::Value *size, const std::string &name);
     llvm::Type *get_type(Type t);
     llvm::FunctionType *get_function_type(Function *fun);
 public:
-    CodegenLLVM(Program *program);
+    CodegenLLVM(Program *program, bool instrument = false);
+    bool set_target(const std::string &triple, const std::string &cpu, const std::string &features, bool multiversion);
+    void set_target(std::shared_ptr<llvm::TargetMachine> machine, bool multiversion);
+    std::shared_ptr<llvm::TargetMachine> get_target();
     llvm::Module *compile();
+    llvm::Module *compile_function(Function *fun);
+    llvm::Module *compile_call_thunk(Function *fun);
+    std::unique_ptr<llvm::LLVMContext> take_context();
+    llvm::Function *get_call_thunk(Function *fun);
+    static std::string symbol_name(Function *fun);
 };
 
 #endif //EPICA_CODEGEN_LLVM_H
@@ -0,0 +1,92 @@
+#include <algorithm>
+#include <climits>
+#include <format>
+#include <iostream>
+#include "const_evaluator.h"
+#include "interpreter.h"
+#include "error.h"
+
+ConstEvaluator::ConstEvaluator(Program *program, bool verbose) : program(program), verbose(verbose) {}
+
+/* Everything the initializer runs has to be interpretable, and may only
+   read tables evaluated before */
+bool ConstEvaluator::check(Const *constant, Node *node, std::unordered_set<Function *> &visited) {
+    Function *func = nullptr;
+    if (node->kind == NodeKind::Statement && static_cast<Statement *>(node)->kind == StatementKind::Call)
+        func = static_cast<Call *>(node)->func;
+    else if (node->kind == NodeKind::Expression && static_cast<Expression *>(node)->kind == ExpressionKind::CallExpr)
+        func = static_cast<CallExpr *>(node)->func;
+
+    if (node->kind == NodeKind::Expression && static_cast<Expression *>(node)->kind == ExpressionKind::Index) {
+        Const *table = static_cast<Index *>(node)->table;
+        if (table->values.empty()) {
+            ast_error(std::format("constant {} read in the initializer of constant {}, which is declared before it",
+                                  table->name, constant->name), node->loc);
+            return false;
+        }
+    }
+    if (func && visited.insert(func).second && (!Interpreter::supports(func) || !check(constant, func, visited)))
+        return false;
+
+    for (Node *child : node->children) {
+        if (!check(constant, child, visited))
+            return false;
+    }
+    return true;
+}
+
+bool ConstEvaluator::run() {
+    if (program->consts.empty())
+        return true;
+
+    /* Plain interpretation, the initializers run once */
+    Interpreter interpreter(program);
+    for (Const *constant : program->consts) {
+        std::unordered_set<Function *> visited = {constant->init};
+        if (!Interpreter::supports(constant->init) || !check(constant, constant->init, visited))
+            return false;
+
+        unsigned bits = type_bits(constant->type);
+        for (long at = constant->from; at <= constant->to; at++) {
+            long value = interpreter.run(constant->init, {at});
+            long limit = bits && bits < 64 ? 1l << (bits - 1) : LONG_MAX;
+            if (bits && (value < -limit || value > limit - 1)) {
+                ast_error(std::format("entry {} of constant {} is {}, out of range of {}",
+                                      at, constant->name, value, type_to_string(constant->type)), constant->loc);
+                return false;
+            }
+            constant->values.emplace_back(value);
+        }
+        if (verbose)
+            std::cerr << constant->loc << ":" << std::endl
+                      << std::format("constant {} evaluated, {} entries", constant->name, constant->values.size())
+                      << '\n';
+    }
+
+    /* Functions only called from initializers are not compiled */
+    std::unordered_set<Function *> inits;
+    for (Const *constant : program->consts)
+        inits.insert(constant->init);
+    bool library = std::none_of(program->children.begin(), program->children.end(), [](Node *child) {
+        return is_exported(static_cast<Function *>(child)->name);
+    });
+    std::vector<Function *> worklist;
+    for (Node *child : program->children) {
+        Function *func = static_cast<Function *>(child);
+        bool root = func->reachable && !inits.contains(func) && (library || is_exported(func->name));
+        func->reachable = root;
+        if (root)
+            worklist.emplace_back(func);
+    }
+    while (!worklist.empty()) {
+        Function *func = worklist.back();
+        worklist.pop_back();
+        for (Function *callee : func->callees) {
+            if (!callee->reachable) {
+                callee->reachable = true;
+                worklist.emplace_back(callee);
+            }
+        }
+    }
+    return true;
+}
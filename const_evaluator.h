@@ -0,0 +1,22 @@
+#ifndef EPICA_CONST_EVALUATOR_H
+#define EPICA_CONST_EVALUATOR_H
+
+#include <unordered_set>
+#include "ast.h"
+
+/* Evaluation of constant tables at compile time: the initializer of every
+   table is interpreted once per entry, in declaration order, so that tables
+   may be computed from earlier ones. The initializers are not compiled
+   afterwards, the functions they call only if reachable otherwise. */
+class ConstEvaluator {
+private:
+    Program *program;
+    bool verbose;
+
+    bool check(Const *constant, Node *node, std::unordered_set<Function *> &visited);
+public:
+    ConstEvaluator(Program *program, bool verbose = false);
+    bool run();
+};
+
+#endif //EPICA_CONST_EVALUATOR_H
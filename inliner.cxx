@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <format>
+#include <iostream>
+#include "inliner.h"
+
+/* Cost model: callees of at most this many nodes are inlined unless
+   declared noinline, larger ones only if declared inline. Callers stop
+   growing at the second limit. */
+static const size_t max_size = 40;
+static const size_t max_caller_size = 4000;
+
+/* Returns are only supported where they leave the function anyway, they
+   become assignments to the result then */
+static bool tail_returns(Node *node, bool tail) {
+    if (node->kind != NodeKind::Statement)
+        return true;
+    Statement *statement = static_cast<Statement *>(node);
+    switch (statement->kind) {
+        case StatementKind::Call:
+            return static_cast<Call *>(statement)->func_name != "return" || tail;
+        case StatementKind::Block:
+            for (size_t i = 0; i < statement->children.size(); i++) {
+                if (!tail_returns(statement->children[i], tail && i == statement->children.size() - 1))
+                    return false;
+            }
+            return true;
+        case StatementKind::If:
+        case StatementKind::Case:
+            for (Node *child : statement->children) {
+                if (!tail_returns(child, tail))
+                    return false;
+            }
+            return true;
+        case StatementKind::While:
+        case StatementKind::For:
+            return tail_returns(statement->children.back(), false);
+        case StatementKind::Parallel:
+        case StatementKind::Spawn:
+        case StatementKind::Sync:
+            /* Outlined bodies and task frames belong to the callee */
+            return false;
+        default:
+            return true;
+    }
+}
+
+Inliner::Inliner(Program *program, bool verbose)
+    : program(program), verbose(verbose), current_func(nullptr), current_size(0), expansions(0) {}
+
+bool Inliner::reaches(Function *from, Function *to, std::unordered_set<Function *> &visited) {
+    for (Function *callee : from->callees) {
+        if (callee == to || (visited.insert(callee).second && reaches(callee, to, visited)))
+            return true;
+    }
+    return false;
+}
+
+bool Inliner::can_inline(Function *func) {
+    auto found = inlinable.find(func);
+    if (found != inlinable.end())
+        return found->second;
+
+    /* Memo functions keep their cache and hot ones their versions */
+    bool result = !func->memo && !func->hot && func->inline_hint != InlineHint::Never
+                  && (func->inline_hint == InlineHint::Always || tree_size(func->body) <= max_size)
+                  && tail_returns(func->body, true)
+                  && (func->type == Type::Void || !type_lanes(func->type) || always_returns(func->body));
+    if (result) {
+        std::unordered_set<Function *> visited;
+        result = !reaches(func, func, visited);
+    }
+    inlinable.insert({func, result});
+    return result;
+}
+
+/* Calls in evaluation order, whether they are inlined, and the growth of
+   the caller if they are. Calls in arguments of inlined ones move along
+   with them. */
+void Inliner::collect_calls(Node *node, std::vector<bool> &calls, size_t &growth, bool moved) {
+    CallExpr *call = nullptr;
+    if (node->kind == NodeKind::Expression && static_cast<Expression *>(node)->kind == ExpressionKind::CallExpr)
+        call = static_cast<CallExpr *>(node);
+    bool inlined = call && call->func && can_inline(call->func);
+    for (Node *child : node->children)
+        collect_calls(child, calls, growth, moved || inlined);
+
+    if (inlined) {
+        calls.emplace_back(true);
+        growth += tree_size(call->func->body);
+    } else if (call && !moved && (call->func || call->func_name == "read" || call->func_name == "read_char")) {
+        calls.emplace_back(false);
+    }
+}
+
+void Inliner::process(Function *func) {
+    if (!processed.insert(func).second)
+        return;
+    /* Callees first, so that what they inline is inlined along with them */
+    for (Function *callee : std::vector<Function *>(func->callees))
+        process(callee);
+
+    current_func = func;
+    current_size = tree_size(func);
+    func->body = static_cast<Block *>(inline_calls(func->body));
+    func->children[0] = func->body;
+}
+
+Statement *Inliner::inline_calls(Statement *statement) {
+    std::unordered_map<Node *, Node *> map;
+    for (Node *&child : statement->children) {
+        Node *replaced = child->kind == NodeKind::Statement ? inline_calls(static_cast<Statement *>(child)) : child;
+        map.insert({child, replaced});
+        child = replaced;
+    }
+    remap_children(statement, map);
+
+    /* Expressions of these are evaluated once, before anything else the
+       statement does */
+    switch (statement->kind) {
+        case StatementKind::Assignment:
+        case StatementKind::Call:
+        case StatementKind::If:
+        case StatementKind::Case:
+        case StatementKind::For:
+        case StatementKind::Parallel:
+            break;
+        default:
+            return statement;
+    }
+    Function *called = statement->kind == StatementKind::Call ? static_cast<Call *>(statement)->func : nullptr;
+
+    /* Inlined calls are moved before the statement, which must not
+       reorder them with calls staying in place */
+    std::vector<bool> calls;
+    size_t growth = 0;
+    bool inlined = called && can_inline(called);
+    for (Node *child : statement->children) {
+        if (child->kind == NodeKind::Expression)
+            collect_calls(child, calls, growth, inlined);
+    }
+    if (inlined) {
+        calls.emplace_back(true);
+        growth += tree_size(called->body);
+    }
+    auto first_kept = std::find(calls.begin(), calls.end(), false);
+    if (std::find(calls.begin(), first_kept, true) == first_kept
+        || std::find(first_kept, calls.end(), true) != calls.end()
+        || current_size + growth > max_caller_size)
+        return statement;
+
+    std::vector<Statement *> prelude;
+    map.clear();
+    for (Node *&child : statement->children) {
+        Node *replaced = child->kind == NodeKind::Expression ? hoist(static_cast<Expression *>(child), prelude)
+                                                             : child;
+        map.insert({child, replaced});
+        child = replaced;
+    }
+    remap_children(statement, map);
+
+    if (inlined)
+        expand(called, static_cast<Call *>(statement)->args, prelude, statement->loc);
+    else
+        prelude.emplace_back(statement);
+    return new Block(prelude, statement->loc);
+}
+
+Expression *Inliner::hoist(Expression *expr, std::vector<Statement *> &prelude) {
+    std::unordered_map<Node *, Node *> map;
+    for (Node *&child : expr->children) {
+        Node *replaced = hoist(static_cast<Expression *>(child), prelude);
+        map.insert({child, replaced});
+        child = replaced;
+    }
+    remap_children(expr, map);
+
+    if (expr->kind == ExpressionKind::CallExpr) {
+        CallExpr *call = static_cast<CallExpr *>(expr);
+        if (call->func && can_inline(call->func))
+            return expand(call->func, call->args, prelude, call->loc);
+    }
+    return expr;
+}
+
+Identifier *Inliner::expand(Function *callee, const std::vector<Expression *> &args,
+                            std::vector<Statement *> &prelude, yy::location loc) {
+    /* Names with a dot cannot clash with names from the source */
+    int n = expansions++;
+    std::string suffix = std::format(".inl{}", n);
+    for (size_t i = 0; i < args.size(); i++) {
+        const Parameter &param = callee->params[i];
+        prelude.emplace_back(new Variable(param.type, param.name + suffix, loc));
+        prelude.emplace_back(new Assignment(param.name + suffix, args[i], loc));
+    }
+
+    std::string result;
+    if (callee->type != Type::Void) {
+        result = std::format("{}.result{}", callee->name, n);
+        prelude.emplace_back(new Variable(callee->type, result, loc));
+        /* Falling off the end returns zero */
+        if (!always_returns(callee->body)) {
+            Expression *zero = callee->type == Type::Bool ? static_cast<Expression *>(new Boolean(false, loc))
+                                                          : new Integer(0, loc);
+            zero->type = callee->type;
+            prelude.emplace_back(new Assignment(result, zero, loc));
+        }
+    }
+    prelude.emplace_back(static_cast<Statement *>(clone(callee->body, suffix, result)));
+
+    current_size += tree_size(callee->body);
+    for (Function *indirect : callee->callees) {
+        if (std::find(current_func->callees.begin(), current_func->callees.end(), indirect)
+            == current_func->callees.end())
+            current_func->callees.emplace_back(indirect);
+    }
+    if (verbose)
+        std::cerr << loc << ":" << std::endl
+                  << std::format("function {} inlined into {}", callee->name, current_func->name) << '\n';
+
+    if (result.empty())
+        return nullptr;
+    Identifier *value = new Identifier(result, loc);
+    value->type = callee->type;
+    return value;
+}
+
+Node *Inliner::clone(Node *node, const std::string &suffix, const std::string &result) {
+    if (node->kind == NodeKind::Statement && static_cast<Statement *>(node)->kind == StatementKind::Call
+        && static_cast<Call *>(node)->func_name == "return") {
+        Call *ret = static_cast<Call *>(node);
+        if (ret->args.empty())
+            return new Block({}, ret->loc);
+        return new Assignment(result, static_cast<Expression *>(clone(ret->args[0], suffix, result)), ret->loc);
+    }
+
+    /* All names in a function body are its parameters and variables */
+    Node *copy = copy_node(node);
+    if (copy->kind == NodeKind::Expression) {
+        if (static_cast<Expression *>(copy)->kind == ExpressionKind::Identifier)
+            static_cast<Identifier *>(copy)->name += suffix;
+    } else {
+        Statement *statement = static_cast<Statement *>(copy);
+        if (statement->kind == StatementKind::Variable)
+            static_cast<Variable *>(statement)->name += suffix;
+        else if (statement->kind == StatementKind::Assignment)
+            static_cast<Assignment *>(statement)->var_name += suffix;
+    }
+
+    std::unordered_map<Node *, Node *> map;
+    for (Node *&child : copy->children) {
+        Node *child_copy = clone(child, suffix, result);
+        map.insert({child, child_copy});
+        child = child_copy;
+    }
+    remap_children(copy, map);
+    return copy;
+}
+
+void Inliner::run() {
+    for (Node *child : program->children) {
+        Function *func = static_cast<Function *>(child);
+        if (func->reachable)
+            process(func);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef EPICA_INLINER_H
+#define EPICA_INLINER_H
+
+#include <unordered_map>
+#include <unordered_set>
+#include "ast.h"
+
+/* Inliner on the analysed AST, so that builds which skip the LLVM inliner
+   do not pay for calls of small helpers either. Calls of small
+   non-recursive functions, and of functions declared inline, are replaced
+   by a copy of the callee body placed before the statement containing the
+   call, with parameters and variables renamed and the result passed
+   through a variable. */
+class Inliner {
+private:
+    Program *program;
+    bool verbose;
+    std::unordered_map<Function *, bool> inlinable;
+    std::unordered_set<Function *> processed;
+    Function *current_func;
+    size_t current_size;
+    int expansions;
+
+    bool reaches(Function *from, Function *to, std::unordered_set<Function *> &visited);
+    bool can_inline(Function *func);
+    void collect_calls(Node *node, std::vector<bool> &calls, size_t &growth, bool moved);
+    void process(Function *func);
+    Statement *inline_calls(Statement *statement);
+    Expression *hoist(Expression *expr, std::vector<Statement *> &prelude);
+    Identifier *expand(Function *callee, const std::vector<Expression *> &args, std::vector<Statement *> &prelude,
+                       yy::location loc);
+    Node *clone(Node *node, const std::string &suffix, const std::string &result);
+public:
+    Inliner(Program *program, bool verbose = false);
+    void run();
+};
+
+#endif //EPICA_INLINER_H
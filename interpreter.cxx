@@ -0,0 +1,397 @@
+#include <bit>
+#include <cassert>
+#include <format>
+#include "interpreter.h"
+#include "codegen_llvm.h"
+#include "error.h"
+
+/* Runtime from libepica, shared with compiled code so that output stays ordered */
+extern "C" {
+long epica_read();
+void epica_write(long x);
+}
+
+Interpreter::Interpreter(Program *program, long threshold)
+    : program(program), threshold(threshold), current_func(nullptr), current_state(nullptr), current_vars(nullptr),
+      returning(false),
+      return_value(0), jit_initialized(false), jit_failed(false), stopping(false) {
+    for (Node *child : program->children)
+        states[static_cast<Function *>(child)];
+    if (threshold)
+        compiler = std::thread(&Interpreter::compile_loop, this);
+}
+
+Interpreter::~Interpreter() {
+    if (!compiler.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(queue_lock);
+        stopping = true;
+    }
+    queue_cond.notify_one();
+    compiler.join();
+}
+
+/* Values are single words, so vectors cannot be interpreted. Narrow
+   integers would need wrapping after every operation. */
+bool Interpreter::supports(Node *node) {
+    std::vector<Type> types;
+    if (node->kind == NodeKind::Function) {
+        Function *func = static_cast<Function *>(node);
+        types.emplace_back(func->type);
+        for (Parameter &param : func->params)
+            types.emplace_back(param.type);
+    } else if (node->kind == NodeKind::Expression) {
+        types.emplace_back(static_cast<Expression *>(node)->type);
+    } else if (static_cast<Statement *>(node)->kind == StatementKind::Variable) {
+        types.emplace_back(static_cast<Variable *>(node)->type);
+    }
+    for (Type type : types) {
+        if (type_lanes(type)) {
+            ast_error("vector types are not supported by the interpreter", node->loc);
+            return false;
+        }
+        if (type_bits(type) && type != Type::Int) {
+            ast_error(std::format("{} type is not supported by the interpreter", type_to_string(type)), node->loc);
+            return false;
+        }
+    }
+
+    for (Node *child : node->children) {
+        if (!supports(child))
+            return false;
+    }
+    return true;
+}
+
+long Interpreter::run(Function *func, std::vector<long> args) {
+    return call(func, args);
+}
+
+void Interpreter::count(Function *func, FunctionState &state) {
+    if (!threshold || state.queued || state.calls + state.backedges < threshold)
+        return;
+    state.queued = true;
+    {
+        std::lock_guard<std::mutex> lock(queue_lock);
+        queue.emplace_back(func);
+    }
+    queue_cond.notify_one();
+}
+
+void Interpreter::compile_loop() {
+    for (;;) {
+        Function *func;
+        {
+            std::unique_lock<std::mutex> lock(queue_lock);
+            queue_cond.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (stopping)
+                return;
+            func = queue.front();
+            queue.pop_front();
+        }
+        if (!jit_failed && !compile(func))
+            jit_failed = true; /* keep interpreting */
+    }
+}
+
+bool Interpreter::compile(Function *func) {
+    /* Functions and their thunks are generated and compiled one by one, so
+       that the first hot function does not wait for the whole program. Its
+       callees are compiled once hot too, or when first called natively. */
+    if (!jit_initialized) {
+        std::vector<std::string> names;
+        for (Node *child : program->children) {
+            Function *fun = static_cast<Function *>(child);
+            if (!fun->reachable)
+                continue;
+            for (std::string name : {CodegenLLVM::symbol_name(fun), CodegenLLVM::symbol_name(fun) + ".thunk"}) {
+                symbols.insert({name, fun});
+                names.emplace_back(name);
+            }
+        }
+        auto generate = [this](const std::string &name) {
+            CodegenLLVM codegen(program);
+            Function *fun = symbols.at(name);
+            std::unique_ptr<llvm::Module> mod(name.ends_with(".thunk") ? codegen.compile_call_thunk(fun)
+                                                                       : codegen.compile_function(fun));
+            return llvm::orc::ThreadSafeModule(std::move(mod), codegen.take_context());
+        };
+        if (!jit.initialize(0) || !jit.add_lazy_functions(names, generate))
+            return false;
+        jit_initialized = true;
+    }
+
+    /* The body is compiled here rather than on the first call through the thunk */
+    void *address;
+    if (!jit.lookup(CodegenLLVM::symbol_name(func), address))
+        return false;
+    if (!jit.lookup(CodegenLLVM::symbol_name(func) + ".thunk", address))
+        return false;
+    /* The map is filled before the thread starts, at() never inserts */
+    states.at(func).native.store(reinterpret_cast<NativeThunk>(address), std::memory_order_release);
+    return true;
+}
+
+long Interpreter::call(Function *func, std::vector<long> &args) {
+    FunctionState &state = states.at(func);
+    NativeThunk native = state.native.load(std::memory_order_acquire);
+    if (native) {
+        long result = 0;
+        native(args.data(), &result);
+        return result;
+    }
+    if (func->memo) {
+        auto &results = memo_results[func];
+        auto cached = results.find(args);
+        if (cached != results.end())
+            return cached->second;
+    }
+    state.calls++;
+    count(func, state);
+
+    std::unordered_map<std::string, long> vars;
+    for (size_t i = 0; i < func->params.size(); i++)
+        vars[func->params[i].name] = args[i];
+    Function *parent_func = current_func;
+    FunctionState *parent_state = current_state;
+    std::unordered_map<std::string, long> *parent_vars = current_vars;
+    current_func = func;
+    current_state = &state;
+    current_vars = &vars;
+
+    /* Note: like compiled code, functions return 0 by default */
+    return_value = 0;
+    exec(func->body);
+    long result = return_value;
+    returning = false;
+
+    current_func = parent_func;
+    current_state = parent_state;
+    current_vars = parent_vars;
+    /* A full bounded table keeps its entries, new results are just not cached */
+    if (func->memo) {
+        auto &results = memo_results[func];
+        if (!func->memo_capacity || results.size() < static_cast<size_t>(func->memo_capacity))
+            results.insert({args, result});
+    }
+    return result;
+}
+
+void Interpreter::exec(Statement *statement) {
+    switch (statement->kind) {
+        case StatementKind::Block:
+            for (Node *child : statement->children) {
+                exec(static_cast<Statement *>(child));
+                if (returning)
+                    return;
+            }
+            break;
+        case StatementKind::Variable:
+            (*current_vars)[static_cast<Variable *>(statement)->name] = 0;
+            break;
+        case StatementKind::Assignment: {
+            Assignment *assignment = static_cast<Assignment *>(statement);
+            (*current_vars)[assignment->var_name] = eval(assignment->expr);
+            break;
+        }
+        case StatementKind::If: {
+            If *i = static_cast<If *>(statement);
+            if (eval(i->pred))
+                exec(i->positive);
+            else if (i->negative)
+                exec(i->negative);
+            break;
+        }
+        case StatementKind::While: {
+            /* Note: like compiled code, the body runs before the predicate */
+            While *wh = static_cast<While *>(statement);
+            do {
+                exec(wh->body);
+                if (returning)
+                    return;
+                current_state->backedges++;
+                count(current_func, *current_state);
+            } while (eval(wh->pred));
+            break;
+        }
+        case StatementKind::Case: {
+            Case *c = static_cast<Case *>(statement);
+            long selector = eval(c->expr);
+            for (CaseArm &arm : c->arms) {
+                for (Expression *label : arm.labels) {
+                    if (static_cast<Integer *>(label)->value == selector) {
+                        exec(arm.body);
+                        return;
+                    }
+                }
+            }
+            if (c->otherwise)
+                exec(c->otherwise);
+            break;
+        }
+        case StatementKind::For: {
+            For *f = static_cast<For *>(statement);
+            long step = f->step ? static_cast<Integer *>(f->step)->value : 1;
+            long from = eval(f->from);
+            long to = eval(f->to);
+            if (step > 0 ? from > to : from < to)
+                break;
+            /* Same last value as compiled code, so the induction variable never overflows */
+            unsigned long distance = step > 0 ? static_cast<unsigned long>(to) - from
+                                              : static_cast<unsigned long>(from) - to;
+            long last = static_cast<long>(from + distance / std::abs(step) * step);
+            for (long i = from;; i += step) {
+                (*current_vars)[f->var->name] = i;
+                exec(f->body);
+                if (returning)
+                    return;
+                current_state->backedges++;
+                count(current_func, *current_state);
+                if (i == last)
+                    break;
+            }
+            break;
+        }
+        case StatementKind::Parallel: {
+            /* Iterations run in order, which is one of the valid schedules */
+            Parallel *par = static_cast<Parallel *>(statement);
+            long from = eval(par->from);
+            long to = eval(par->to);
+            for (long i = from; i <= to; i++) {
+                (*current_vars)[par->var->name] = i;
+                exec(par->body);
+                current_state->backedges++;
+                count(current_func, *current_state);
+                if (i == to)
+                    break;
+            }
+            break;
+        }
+        case StatementKind::Call: {
+            Call *call = static_cast<Call *>(statement);
+            std::vector<long> args;
+            for (Expression *arg : call->args)
+                args.emplace_back(eval(arg));
+            if (call->func_name == "return") {
+                return_value = args.empty() ? 0 : args[0];
+                returning = true;
+            } else if (call->func_name == "write") {
+                epica_write(args[0]);
+            } else {
+                this->call(call->func, args);
+            }
+            break;
+        }
+        case StatementKind::Spawn: {
+            /* Spawned calls are run right away, sync has nothing to wait for */
+            Spawn *spawn = static_cast<Spawn *>(statement);
+            long result = eval(spawn->call);
+            if (!spawn->var_name.empty())
+                (*current_vars)[spawn->var_name] = result;
+            break;
+        }
+        case StatementKind::Sync:
+            break;
+    }
+}
+
+long Interpreter::eval(Expression *expression) {
+    switch (expression->kind) {
+        case ExpressionKind::Integer:
+            return static_cast<Integer *>(expression)->value;
+        case ExpressionKind::Boolean:
+            return static_cast<Boolean *>(expression)->value;
+        case ExpressionKind::Identifier:
+            return (*current_vars)[static_cast<Identifier *>(expression)->name];
+        case ExpressionKind::Index: {
+            /* Entries out of range read zero, as in compiled code */
+            Index *index = static_cast<Index *>(expression);
+            unsigned long at = eval(index->index) - index->table->from;
+            return at < index->table->values.size() ? index->table->values[at] : 0;
+        }
+        case ExpressionKind::CallExpr: {
+            CallExpr *call = static_cast<CallExpr *>(expression);
+            if (call->func_name == "read")
+                return epica_read();
+            std::vector<long> args;
+            for (Expression *arg : call->args)
+                args.emplace_back(eval(arg));
+            if (is_bit_builtin(call->func_name))
+                return eval_bit_builtin(call->func_name, args);
+            if (is_conversion_builtin(call->func_name))
+                return args[0]; /* int from int or bool */
+            return this->call(call->func, args);
+        }
+        case ExpressionKind::UnOp: {
+            UnOp *unop = static_cast<UnOp *>(expression);
+            long arg = eval(unop->arg);
+            switch (unop->kind) {
+                case UnOpKind::Neg:
+                    return static_cast<long>(0ul - static_cast<unsigned long>(arg));
+                case UnOpKind::Not:
+                    return ~arg;
+                case UnOpKind::LogNot:
+                    return !arg;
+            }
+            break;
+        }
+        case ExpressionKind::BinOp: {
+            BinOp *binop = static_cast<BinOp *>(expression);
+            /* Note: unsigned arithmetic wraps around like in compiled code */
+            unsigned long left = eval(binop->left);
+            unsigned long right = eval(binop->right);
+            switch (binop->kind) {
+                case BinOpKind::Add:
+                    return static_cast<long>(left + right);
+                case BinOpKind::Sub:
+                    return static_cast<long>(left - right);
+                case BinOpKind::Mult:
+                    return static_cast<long>(left * right);
+                case BinOpKind::Or:
+                case BinOpKind::LogOr:
+                    return static_cast<long>(left | right);
+                case BinOpKind::And:
+                case BinOpKind::LogAnd:
+                    return static_cast<long>(left & right);
+                case BinOpKind::Xor:
+                case BinOpKind::LogXor:
+                    return static_cast<long>(left ^ right);
+                case BinOpKind::Eq:
+                    return left == right;
+                case BinOpKind::Lt:
+                    return static_cast<long>(left) < static_cast<long>(right);
+                case BinOpKind::Gt:
+                    return static_cast<long>(left) > static_cast<long>(right);
+                case BinOpKind::Leq:
+                    return static_cast<long>(left) <= static_cast<long>(right);
+                case BinOpKind::Geq:
+                    return static_cast<long>(left) >= static_cast<long>(right);
+                case BinOpKind::Shl:
+                    return static_cast<long>(left << (right & 63));
+                case BinOpKind::Shr:
+                    return static_cast<long>(left >> (right & 63));
+                case BinOpKind::Sar:
+                    return static_cast<long>(left) >> (right & 63);
+            }
+            break;
+        }
+    }
+    assert(false);
+    return 0;
+}
+
+long Interpreter::eval_bit_builtin(const std::string &name, std::vector<long> &args) {
+    unsigned long x = args[0];
+    if (name == "popcount")
+        return std::popcount(x);
+    if (name == "clz")
+        return std::countl_zero(x);
+    if (name == "ctz")
+        return std::countr_zero(x);
+    if (name == "bswap")
+        return static_cast<long>(__builtin_bswap64(x));
+    /* Rotation counts are taken modulo 64 */
+    int count = static_cast<int>(args[1] & 63);
+    return static_cast<long>(name == "rotl" ? std::rotl(x, count) : std::rotr(x, count));
+}
@@ -0,0 +1,65 @@
+#ifndef EPICA_INTERPRETER_H
+#define EPICA_INTERPRETER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include "ast.h"
+#include "jit_llvm.h"
+
+/* Tiered execution: the analysed program is interpreted right away, and
+   functions which become hot (by calls and loop iterations) are compiled
+   one at a time with full optimization in the background and called
+   natively from then on. Without a threshold, everything is interpreted and no compiler
+   thread is started, as for constant tables. */
+class Interpreter {
+private:
+    typedef void (*NativeThunk)(long *args, void *result);
+    struct FunctionState {
+        long calls = 0;
+        long backedges = 0;
+        bool queued = false;
+        std::atomic<NativeThunk> native = nullptr;
+    };
+
+    Program *program;
+    long threshold; /* 0 if not tiering */
+    std::unordered_map<Function *, FunctionState> states;
+    /* Results of memo functions, keeping at most memo_capacity like the runtime */
+    std::unordered_map<Function *, std::map<std::vector<long>, long>> memo_results;
+    Function *current_func;
+    FunctionState *current_state;
+    std::unordered_map<std::string, long> *current_vars;
+    bool returning;
+    long return_value;
+
+    /* Background compilation, owned by the compiler thread */
+    JitLLVM jit;
+    bool jit_initialized;
+    std::unordered_map<std::string, Function *> symbols; /* of the functions and their thunks */
+    bool jit_failed;
+    std::thread compiler;
+    std::mutex queue_lock;
+    std::condition_variable queue_cond;
+    std::deque<Function *> queue;
+    bool stopping;
+
+    long call(Function *func, std::vector<long> &args);
+    void exec(Statement *statement);
+    long eval(Expression *expression);
+    long eval_bit_builtin(const std::string &name, std::vector<long> &args);
+    void count(Function *func, FunctionState &state);
+    void compile_loop();
+    bool compile(Function *func);
+public:
+    Interpreter(Program *program, long threshold = 0);
+    static bool supports(Node *node);
+    ~Interpreter();
+    long run(Function *func, std::vector<long> args = {});
+};
+
+#endif //EPICA_INTERPRETER_H
@@ -0,0 +1,225 @@
+#include <llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/TargetSelect.h>
+#include "jit_llvm.h"
+
+/* Runtime from libepica, built with EPICA_JIT so that read and write do not
+   clash with the ones from libc used by the compiler itself */
+extern "C" {
+long epica_read();
+void epica_write(long x);
+long epica_read_char();
+void epica_write_char(long c);
+int epica_memo_lookup(void *table, long arity, long capacity, const long *key, long *value);
+void epica_memo_store(void *table, long arity, long capacity, const long *key, long value);
+long epica_parallel_for(long first, long last, void *body, long *env, long op);
+void epica_spawn(void *frame, void *task, void *thunk, long *args, void *result);
+void epica_sync(void *frame);
+}
+
+static const std::pair<const char *, void *> runtime_symbols[] = {
+    {"read", reinterpret_cast<void *>(epica_read)},
+    {"write", reinterpret_cast<void *>(epica_write)},
+    {"epica_read_char", reinterpret_cast<void *>(epica_read_char)},
+    {"epica_write_char", reinterpret_cast<void *>(epica_write_char)},
+    {"epica_memo_lookup", reinterpret_cast<void *>(epica_memo_lookup)},
+    {"epica_memo_store", reinterpret_cast<void *>(epica_memo_store)},
+    {"epica_parallel_for", reinterpret_cast<void *>(epica_parallel_for)},
+    {"epica_spawn", reinterpret_cast<void *>(epica_spawn)},
+    {"epica_sync", reinterpret_cast<void *>(epica_sync)},
+};
+
+bool JitLLVM::report(llvm::Error err) {
+    if (!err)
+        return true;
+    llvm::errs() << "jit: " << llvm::toString(std::move(err)) << "\n";
+    return false;
+}
+
+/* Defines a single function, whose module is only generated once the
+   function has to be compiled */
+class FunctionMaterializationUnit : public llvm::orc::MaterializationUnit {
+private:
+    std::string name;
+    std::shared_ptr<JitLLVM::ModuleGenerator> generate;
+    llvm::orc::IRLayer &layer;
+    const llvm::DataLayout &data_layout;
+public:
+    FunctionMaterializationUnit(llvm::orc::SymbolStringPtr symbol, const std::string &name,
+                                std::shared_ptr<JitLLVM::ModuleGenerator> generate, llvm::orc::IRLayer &layer,
+                                const llvm::DataLayout &data_layout)
+        : MaterializationUnit(Interface(llvm::orc::SymbolFlagsMap{{symbol, llvm::JITSymbolFlags::Exported
+                                                                           | llvm::JITSymbolFlags::Callable}},
+                                        nullptr)),
+          name(name), generate(std::move(generate)), layer(layer), data_layout(data_layout) {}
+
+    llvm::StringRef getName() const override {
+        return name;
+    }
+
+    void materialize(std::unique_ptr<llvm::orc::MaterializationResponsibility> responsibility) override {
+        llvm::orc::ThreadSafeModule tsm = (*generate)(name);
+        tsm.withModuleDo([this](llvm::Module &mod) {
+            if (mod.getDataLayout().isDefault())
+                mod.setDataLayout(data_layout);
+        });
+        layer.emit(std::move(responsibility), std::move(tsm));
+    }
+
+    void discard(const llvm::orc::JITDylib &, const llvm::orc::SymbolStringPtr &) override {}
+};
+
+bool JitLLVM::initialize(unsigned compile_threads) {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    /* Without compile threads, functions are compiled on the threads that
+       first call them, which may be several workers of the program at once */
+    auto created = llvm::orc::LLLazyJITBuilder()
+            .setNumCompileThreads(compile_threads)
+            .setCompileFunctionCreator([](llvm::orc::JITTargetMachineBuilder machine)
+                                               -> llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+                return std::make_unique<llvm::orc::ConcurrentIRCompiler>(std::move(machine));
+            })
+            .create();
+    if (!created)
+        return report(created.takeError());
+    jit = std::move(*created);
+
+    jit->setPartitionFunction(llvm::orc::CompileOnDemandLayer::compileWholeModule);
+    jit->getIRTransformLayer().setTransform([](llvm::orc::ThreadSafeModule tsm,
+                                               const llvm::orc::MaterializationResponsibility &) {
+        tsm.withModuleDo([](llvm::Module &mod) {
+            llvm::LoopAnalysisManager lam;
+            llvm::FunctionAnalysisManager fam;
+            llvm::CGSCCAnalysisManager cgam;
+            llvm::ModuleAnalysisManager mam;
+            llvm::PassBuilder pb;
+            pb.registerModuleAnalyses(mam);
+            pb.registerCGSCCAnalyses(cgam);
+            pb.registerFunctionAnalyses(fam);
+            pb.registerLoopAnalyses(lam);
+            pb.crossRegisterProxies(lam, fam, cgam, mam);
+            pb.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2).run(mod, mam);
+        });
+        return llvm::Expected<llvm::orc::ThreadSafeModule>(std::move(tsm));
+    });
+
+    llvm::orc::SymbolMap runtime;
+    for (auto &[name, address] : runtime_symbols)
+        runtime[jit->mangleAndIntern(name)] = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(address),
+                                                                       llvm::JITSymbolFlags::Exported);
+    if (!report(jit->getMainJITDylib().define(llvm::orc::absoluteSymbols(runtime))))
+        return false;
+
+    /* Anything else (e.g. memset emitted by the optimizer) comes from the process */
+    auto generator = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            jit->getDataLayout().getGlobalPrefix());
+    if (!generator)
+        return report(generator.takeError());
+    jit->getMainJITDylib().addGenerator(std::move(*generator));
+    return true;
+}
+
+bool JitLLVM::add_module(std::unique_ptr<llvm::LLVMContext> ctx, std::unique_ptr<llvm::Module> mod) {
+    /* Internal functions would get renamed when added, keep their names
+       so that they can be looked up */
+    for (llvm::Function &func : *mod) {
+        if (!func.isDeclaration() && func.hasLocalLinkage())
+            func.setLinkage(llvm::GlobalValue::ExternalLinkage);
+    }
+    return report(jit->addLazyIRModule(llvm::orc::ThreadSafeModule(std::move(mod), std::move(ctx))));
+}
+
+bool JitLLVM::add_lazy_functions(const std::vector<std::string> &func_names, ModuleGenerator generate) {
+    llvm::orc::ExecutionSession &es = jit->getExecutionSession();
+    llvm::orc::JITDylib &main = jit->getMainJITDylib();
+    auto created = llvm::orc::createLocalLazyCallThroughManager(jit->getTargetTriple(), es, llvm::orc::ExecutorAddr());
+    if (!created)
+        return report(created.takeError());
+    call_through = std::move(*created);
+    stubs = llvm::orc::createLocalIndirectStubsManagerBuilder(jit->getTargetTriple())();
+
+    /* Bodies link against the stubs in the main dylib, so that compiling
+       a function does not compile its callees */
+    impl = &es.createBareJITDylib(main.getName() + ".lazy");
+    impl->setLinkOrder(llvm::orc::makeJITDylibSearchOrder(&main), false);
+
+    auto shared = std::make_shared<ModuleGenerator>(std::move(generate));
+    llvm::orc::SymbolAliasMap aliases;
+    for (const std::string &name : func_names) {
+        llvm::orc::SymbolStringPtr symbol = jit->mangleAndIntern(name);
+        if (!report(impl->define(std::make_unique<FunctionMaterializationUnit>(symbol,
+                                                                               name,
+                                                                               shared,
+                                                                               jit->getIRTransformLayer(),
+                                                                               jit->getDataLayout()))))
+            return false;
+        aliases[symbol] = llvm::orc::SymbolAliasMapEntry(symbol, llvm::JITSymbolFlags::Exported
+                                                                 | llvm::JITSymbolFlags::Callable);
+    }
+    return report(main.define(llvm::orc::lazyReexports(*call_through, *stubs, *impl, std::move(aliases))));
+}
+
+llvm::orc::JITDylib *JitLLVM::implementation() {
+    if (impl)
+        return impl;
+    return jit->getExecutionSession().getJITDylibByName(jit->getMainJITDylib().getName() + ".impl");
+}
+
+void JitLLVM::precompile(const std::vector<std::string> &func_names) {
+    llvm::orc::ExecutionSession &es = jit->getExecutionSession();
+    llvm::orc::SymbolLookupSet symbols;
+    for (const std::string &name : func_names)
+        symbols.add(jit->mangleAndIntern(name), llvm::orc::SymbolLookupFlags::WeaklyReferencedSymbol);
+
+    /* Resolving the stubs sets up the implementation dylib behind them */
+    auto resolved = es.lookup(llvm::orc::makeJITDylibSearchOrder(&jit->getMainJITDylib()), symbols);
+    if (!resolved) {
+        llvm::consumeError(resolved.takeError());
+        return;
+    }
+    llvm::orc::JITDylib *bodies = implementation();
+    if (!bodies)
+        return;
+
+    /* Looking the bodies up there materializes them on the compile
+       threads, without waiting for them */
+    es.lookup(llvm::orc::LookupKind::Static,
+              llvm::orc::makeJITDylibSearchOrder(bodies),
+              std::move(symbols),
+              llvm::orc::SymbolState::Ready,
+              [](llvm::Expected<llvm::orc::SymbolMap> result) {
+                  /* Failures show up again when the function is called */
+                  if (!result)
+                      llvm::consumeError(result.takeError());
+              },
+              llvm::orc::NoDependenciesToRegister);
+}
+
+bool JitLLVM::lookup(const std::string &func_name, void *&address) {
+    /* Resolve the stub first, then compile the body behind it right away */
+    auto stub = jit->lookup(func_name);
+    if (!stub)
+        return report(stub.takeError());
+    address = stub->toPtr<void *>();
+
+    llvm::orc::ExecutionSession &es = jit->getExecutionSession();
+    llvm::orc::JITDylib *bodies = implementation();
+    if (!bodies)
+        return true;
+    auto body = es.lookup(llvm::orc::makeJITDylibSearchOrder(bodies), jit->mangleAndIntern(func_name));
+    if (!body)
+        return report(body.takeError());
+    address = reinterpret_cast<void *>(body->getAddress());
+    return true;
+}
+
+bool JitLLVM::run(const std::string &func_name, long &result) {
+    auto symbol = jit->lookup(func_name);
+    if (!symbol)
+        return report(symbol.takeError());
+    result = symbol->toPtr<long (*)()>()();
+    return true;
+}
@@ -0,0 +1,38 @@
+#ifndef EPICA_JIT_LLVM_H
+#define EPICA_JIT_LLVM_H
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <llvm/ExecutionEngine/Orc/IndirectionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/LazyReexports.h>
+
+/* Lazy JIT: with add_lazy_functions, every function is generated, optimized
+   and compiled only when it is called for the first time, through ORC lazy
+   reexport stubs. A module added with add_module is optimized and compiled
+   as a whole when any of its functions is needed. */
+class JitLLVM {
+public:
+    /* Returns the module defining the named function, called from the
+       compile threads */
+    typedef std::function<llvm::orc::ThreadSafeModule(const std::string &)> ModuleGenerator;
+private:
+    std::unique_ptr<llvm::orc::LLLazyJIT> jit;
+    std::unique_ptr<llvm::orc::LazyCallThroughManager> call_through;
+    std::unique_ptr<llvm::orc::IndirectStubsManager> stubs;
+    llvm::orc::JITDylib *impl = nullptr; /* bodies behind the stubs */
+
+    bool report(llvm::Error err);
+    llvm::orc::JITDylib *implementation();
+public:
+    bool initialize(unsigned compile_threads);
+    bool add_module(std::unique_ptr<llvm::LLVMContext> ctx, std::unique_ptr<llvm::Module> mod);
+    bool add_lazy_functions(const std::vector<std::string> &func_names, ModuleGenerator generate);
+    void precompile(const std::vector<std::string> &func_names);
+    bool lookup(const std::string &func_name, void *&address);
+    bool run(const std::string &func_name, long &result);
+};
+
+#endif //EPICA_JIT_LLVM_H
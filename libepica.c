@@ -1,4 +1,18 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysinfo.h>
+#include <time.h>
+
+/* When linked into the compiler for JIT execution, read and write must
+   not replace the ones from libc */
+#ifdef EPICA_JIT
+#define read epica_read
+#define write epica_write
+#endif
 
 long read() {
     long x;
@@ -9,3 +23,894 @@ long read() {
 void write(long x) {
     printf("%ld\n", x);
 }
+
+/* Character I/O for char values, which are passed as longs */
+long epica_read_char() {
+    int c = getchar();
+    return c == EOF ? -1 : (signed char) c;
+}
+
+void epica_write_char(long c) {
+    putchar((unsigned char) c);
+}
+
+/* Result cache of memo functions, open addressing with linear probing.
+   Keys are the arguments of the call, one long per parameter. Memo calls
+   may run on parallel workers and spawned tasks at once, so lookups share
+   the lock of the table and stores, which may grow it, hold it alone. */
+struct epica_memo {
+    pthread_rwlock_t lock;
+    long arity;
+    long capacity; /* maximum number of entries, 0 means unbounded */
+    long size;     /* number of slots, always a power of two */
+    long count;
+    long *keys;
+    long *values;
+    char *used;
+};
+
+static unsigned long memo_hash(long arity, const long *key) {
+    unsigned long h = 0x9e3779b97f4a7c15ul;
+    for (long i = 0; i < arity; i++) {
+        h ^= (unsigned long)key[i];
+        h *= 0xbf58476d1ce4e5b9ul;
+        h ^= h >> 31;
+    }
+    return h;
+}
+
+static void memo_alloc(struct epica_memo *memo, long size) {
+    memo->size = size;
+    memo->keys = malloc(size * (memo->arity ? memo->arity : 1) * sizeof(long));
+    memo->values = malloc(size * sizeof(long));
+    memo->used = calloc(size, 1);
+    if (!memo->keys || !memo->values || !memo->used) {
+        fprintf(stderr, "epica: out of memory in memo table\n");
+        exit(1);
+    }
+}
+
+/* Returns the slot holding the key, or the free slot where it belongs */
+static long memo_find(struct epica_memo *memo, const long *key) {
+    long mask = memo->size - 1;
+    long slot = memo_hash(memo->arity, key) & mask;
+    while (memo->used[slot]
+           && memcmp(memo->keys + slot * memo->arity, key, memo->arity * sizeof(long)) != 0)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+static void memo_insert(struct epica_memo *memo, const long *key, long value) {
+    long slot = memo_find(memo, key);
+    if (!memo->used[slot]) {
+        memcpy(memo->keys + slot * memo->arity, key, memo->arity * sizeof(long));
+        memo->used[slot] = 1;
+        memo->count++;
+    }
+    memo->values[slot] = value;
+}
+
+static struct epica_memo *memo_create(long arity, long capacity) {
+    struct epica_memo *memo = calloc(1, sizeof(struct epica_memo));
+    long size = 64;
+    if (!memo) {
+        fprintf(stderr, "epica: out of memory in memo table\n");
+        exit(1);
+    }
+    pthread_rwlock_init(&memo->lock, NULL);
+    memo->arity = arity;
+    memo->capacity = capacity;
+    /* Bounded tables are allocated once, with load factor at most 1/2 */
+    while (capacity && size < 2 * capacity)
+        size *= 2;
+    memo_alloc(memo, size);
+    return memo;
+}
+
+static void memo_grow(struct epica_memo *memo) {
+    long old_size = memo->size;
+    long *old_keys = memo->keys;
+    long *old_values = memo->values;
+    char *old_used = memo->used;
+
+    memo->count = 0;
+    memo_alloc(memo, old_size * 2);
+    for (long i = 0; i < old_size; i++) {
+        if (old_used[i])
+            memo_insert(memo, old_keys + i * memo->arity, old_values[i]);
+    }
+    free(old_keys);
+    free(old_values);
+    free(old_used);
+}
+
+static pthread_mutex_t memo_create_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Creates the table on first use, only once even when threads race for it */
+static struct epica_memo *memo_get(struct epica_memo **table, long arity, long capacity) {
+    struct epica_memo *memo = __atomic_load_n(table, __ATOMIC_ACQUIRE);
+    if (memo)
+        return memo;
+    pthread_mutex_lock(&memo_create_lock);
+    memo = __atomic_load_n(table, __ATOMIC_ACQUIRE);
+    if (!memo) {
+        memo = memo_create(arity, capacity);
+        __atomic_store_n(table, memo, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&memo_create_lock);
+    return memo;
+}
+
+int epica_memo_lookup(struct epica_memo **table, long arity, long capacity, const long *key, long *value) {
+    struct epica_memo *memo = memo_get(table, arity, capacity);
+    long slot;
+    int found;
+    pthread_rwlock_rdlock(&memo->lock);
+    slot = memo_find(memo, key);
+    found = memo->used[slot];
+    if (found)
+        *value = memo->values[slot];
+    pthread_rwlock_unlock(&memo->lock);
+    return found;
+}
+
+void epica_memo_store(struct epica_memo **table, long arity, long capacity, const long *key, long value) {
+    struct epica_memo *memo = memo_get(table, arity, capacity);
+    pthread_rwlock_wrlock(&memo->lock);
+    /* A full bounded table keeps its entries, new results are just not cached */
+    if (!memo->capacity || memo->count < memo->capacity) {
+        if (2 * (memo->count + 1) > memo->size)
+            memo_grow(memo);
+        memo_insert(memo, key, value);
+    }
+    pthread_rwlock_unlock(&memo->lock);
+}
+
+/* Work-stealing scheduler for parallel loops. Every worker owns a range
+   of iterations, runs chunks from its front and, once it runs dry, steals
+   the back half of the range of a random victim. The calling thread acts
+   as worker 0. Ranges are offsets from the first iteration, so that loops
+   may run up to LONG_MAX, and bodies get the first and last iteration of a
+   chunk. */
+typedef long (*epica_parallel_body)(long *env, long first, long last);
+
+enum epica_reduction {
+    EPICA_REDUCE_NONE,
+    EPICA_REDUCE_ADD,
+    EPICA_REDUCE_MULT,
+    EPICA_REDUCE_AND,
+    EPICA_REDUCE_OR,
+};
+
+struct epica_worker {
+    pthread_mutex_t lock;
+    unsigned long from;
+    unsigned long to;
+    long result;
+    unsigned int seed;
+};
+
+static struct {
+    int nworkers;
+    struct epica_worker *workers;
+    pthread_mutex_t owner; /* held by the thread running a loop on the pool */
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    long generation;
+    int active;
+    epica_parallel_body body;
+    long *env;
+    long op;
+    unsigned long base;
+    unsigned long chunk;
+    atomic_ulong remaining;
+} pool = {
+    .owner = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static _Thread_local int in_parallel;
+
+static long reduction_identity(long op) {
+    switch (op) {
+        case EPICA_REDUCE_MULT:
+            return 1;
+        case EPICA_REDUCE_AND:
+            return -1;
+        default:
+            return 0;
+    }
+}
+
+static long reduction_combine(long op, long x, long y) {
+    switch (op) {
+        case EPICA_REDUCE_ADD:
+            return x + y;
+        case EPICA_REDUCE_MULT:
+            return x * y;
+        case EPICA_REDUCE_AND:
+            return x & y;
+        case EPICA_REDUCE_OR:
+            return x | y;
+        default:
+            return 0;
+    }
+}
+
+/* Takes the next chunk of our own range, or steals from someone else */
+static int worker_next(int id, unsigned long *from, unsigned long *to) {
+    struct epica_worker *self = &pool.workers[id];
+
+    while (atomic_load(&pool.remaining) > 0) {
+        pthread_mutex_lock(&self->lock);
+        if (self->from < self->to) {
+            *from = self->from;
+            *to = self->to - self->from > pool.chunk ? self->from + pool.chunk : self->to;
+            self->from = *to;
+            pthread_mutex_unlock(&self->lock);
+            return 1;
+        }
+        pthread_mutex_unlock(&self->lock);
+
+        struct epica_worker *victim = &pool.workers[rand_r(&self->seed) % pool.nworkers];
+        if (victim == self) {
+            sched_yield();
+            continue;
+        }
+        pthread_mutex_lock(&victim->lock);
+        unsigned long stolen_from = victim->to - victim->from > pool.chunk
+                                    ? victim->from + (victim->to - victim->from) / 2
+                                    : victim->from;
+        unsigned long stolen_to = victim->to;
+        victim->to = stolen_from;
+        pthread_mutex_unlock(&victim->lock);
+        if (stolen_from < stolen_to) {
+            pthread_mutex_lock(&self->lock);
+            self->from = stolen_from;
+            self->to = stolen_to;
+            pthread_mutex_unlock(&self->lock);
+        } else {
+            sched_yield();
+        }
+    }
+    return 0;
+}
+
+static void worker_run(int id) {
+    long result = reduction_identity(pool.op);
+    unsigned long from, to;
+
+    in_parallel = 1;
+    while (worker_next(id, &from, &to)) {
+        result = reduction_combine(pool.op, result,
+                                   pool.body(pool.env, (long)(pool.base + from), (long)(pool.base + to - 1)));
+        atomic_fetch_sub(&pool.remaining, to - from);
+    }
+    in_parallel = 0;
+    pool.workers[id].result = result;
+}
+
+static void *worker_thread(void *arg) {
+    int id = (int)(long)arg;
+    long generation = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.generation == generation)
+            pthread_cond_wait(&pool.start, &pool.lock);
+        generation = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        worker_run(id);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.active == 0)
+            pthread_cond_signal(&pool.done);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+static void pool_init(void) {
+    const char *threads = getenv("EPICA_THREADS");
+    pool.nworkers = threads ? atoi(threads) : get_nprocs();
+    if (pool.nworkers < 1)
+        pool.nworkers = 1;
+    pool.workers = calloc(pool.nworkers, sizeof(struct epica_worker));
+    if (!pool.workers) {
+        fprintf(stderr, "epica: out of memory in parallel runtime\n");
+        exit(1);
+    }
+    for (int i = 0; i < pool.nworkers; i++) {
+        pthread_mutex_init(&pool.workers[i].lock, NULL);
+        pool.workers[i].seed = i + 1;
+    }
+    for (int i = 1; i < pool.nworkers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_thread, (void *)(long)i) != 0) {
+            /* Carry on with the workers we have */
+            pool.nworkers = i;
+            break;
+        }
+        pthread_detach(thread);
+    }
+}
+
+/* Runs iterations first to last inclusive */
+long epica_parallel_for(long first, long last, epica_parallel_body body, long *env, long op) {
+    unsigned long n;
+    long result;
+
+    if (first > last)
+        return reduction_identity(op);
+    /* Only the full range of long has more iterations than fit, which
+       would not finish anyway */
+    n = (unsigned long)last - (unsigned long)first + 1;
+    if (n == 0)
+        n = -1ul;
+
+    pthread_once(&pool_once, pool_init);
+    /* Loops inside parallel loops and tiny loops are not worth splitting */
+    if (in_parallel || pool.nworkers == 1 || n < 2)
+        return reduction_combine(op, reduction_identity(op), body(env, first, last));
+    /* Spawned tasks and the main thread may reach parallel loops at the
+       same time, the pool runs one of them and the others run serially on
+       their own thread, which is busy anyway */
+    if (pthread_mutex_trylock(&pool.owner) != 0)
+        return reduction_combine(op, reduction_identity(op), body(env, first, last));
+
+    pool.body = body;
+    pool.env = env;
+    pool.op = op;
+    pool.base = first;
+    pool.chunk = n / (pool.nworkers * 16) > 0 ? n / (pool.nworkers * 16) : 1;
+    atomic_store(&pool.remaining, n);
+    for (int i = 0; i < pool.nworkers; i++) {
+        pool.workers[i].from = (unsigned long)((unsigned __int128)n * i / pool.nworkers);
+        pool.workers[i].to = (unsigned long)((unsigned __int128)n * (i + 1) / pool.nworkers);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.active = pool.nworkers - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    worker_run(0);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.active > 0)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+
+    result = reduction_identity(op);
+    for (int i = 0; i < pool.nworkers; i++)
+        result = reduction_combine(op, result, pool.workers[i].result);
+    pthread_mutex_unlock(&pool.owner);
+    return result;
+}
+
+/* Task parallelism for spawn/sync. Every worker has a Chase-Lev deque of
+   spawned tasks: the owner pushes and pops at the bottom, thieves take
+   from the top. Tasks and frames live in the stack frame of the spawning
+   function, which syncs before returning. */
+typedef void (*epica_task_thunk)(long *args, void *result);
+
+struct epica_frame {
+    atomic_long pending;
+};
+
+struct epica_task {
+    epica_task_thunk thunk;
+    long *args;
+    void *result;
+    struct epica_frame *frame;
+    long depth;
+};
+
+/* Codegen allocates frames and tasks as arrays of longs */
+_Static_assert(sizeof(struct epica_frame) == 1 * sizeof(long), "epica_frame size");
+_Static_assert(sizeof(struct epica_task) == 5 * sizeof(long), "epica_task size");
+
+#define EPICA_DEQUE_SIZE 4096
+
+struct epica_deque {
+    atomic_long top;
+    atomic_long bottom;
+    struct epica_task *_Atomic tasks[EPICA_DEQUE_SIZE];
+};
+
+static struct {
+    int nworkers;
+    long cutoff;
+    struct epica_deque *deques;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    atomic_int sleepers;
+    long wakeups;
+} tasks = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wakeup = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_once_t tasks_once = PTHREAD_ONCE_INIT;
+static _Thread_local struct epica_deque *task_deque;
+static _Thread_local long task_depth;
+static _Thread_local unsigned int task_seed;
+
+static int deque_push(struct epica_deque *deque, struct epica_task *task) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= EPICA_DEQUE_SIZE)
+        return 0;
+    atomic_store_explicit(&deque->tasks[bottom % EPICA_DEQUE_SIZE], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return 1;
+}
+
+static struct epica_task *deque_pop(struct epica_deque *deque) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    long top;
+    struct epica_task *task = NULL;
+
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top <= bottom) {
+        task = atomic_load_explicit(&deque->tasks[bottom % EPICA_DEQUE_SIZE], memory_order_relaxed);
+        if (top == bottom) {
+            /* Last task, race against thieves */
+            if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                         memory_order_seq_cst, memory_order_relaxed))
+                task = NULL;
+            atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+static struct epica_task *deque_steal(struct epica_deque *deque) {
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    long bottom;
+    struct epica_task *task;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom)
+        return NULL;
+    task = atomic_load_explicit(&deque->tasks[top % EPICA_DEQUE_SIZE], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return task;
+}
+
+static struct epica_task *task_steal(void) {
+    struct epica_deque *victim = &tasks.deques[rand_r(&task_seed) % tasks.nworkers];
+    if (victim == task_deque)
+        return NULL;
+    return deque_steal(victim);
+}
+
+static int tasks_available(void) {
+    for (int i = 0; i < tasks.nworkers; i++) {
+        if (atomic_load(&tasks.deques[i].top) < atomic_load(&tasks.deques[i].bottom))
+            return 1;
+    }
+    return 0;
+}
+
+static void task_run(struct epica_task *task) {
+    long depth = task_depth;
+    task_depth = task->depth;
+    task->thunk(task->args, task->result);
+    task_depth = depth;
+    atomic_fetch_sub_explicit(&task->frame->pending, 1, memory_order_release);
+}
+
+static void *task_worker_thread(void *arg) {
+    int failures = 0;
+
+    task_deque = &tasks.deques[(long)arg];
+    task_seed = (unsigned int)(long)arg + 1;
+    for (;;) {
+        struct epica_task *task = task_steal();
+        if (task) {
+            task_run(task);
+            failures = 0;
+            continue;
+        }
+        if (++failures < 64) {
+            sched_yield();
+            continue;
+        }
+
+        /* Nothing to steal for a while, sleep until the next spawn */
+        pthread_mutex_lock(&tasks.lock);
+        atomic_fetch_add(&tasks.sleepers, 1);
+        long wakeups = tasks.wakeups;
+        while (tasks.wakeups == wakeups && !tasks_available())
+            pthread_cond_wait(&tasks.wakeup, &tasks.lock);
+        atomic_fetch_sub(&tasks.sleepers, 1);
+        pthread_mutex_unlock(&tasks.lock);
+        failures = 0;
+    }
+    return NULL;
+}
+
+static void tasks_init(void) {
+    const char *threads = getenv("EPICA_THREADS");
+    const char *cutoff = getenv("EPICA_SPAWN_CUTOFF");
+    tasks.nworkers = threads ? atoi(threads) : get_nprocs();
+    tasks.cutoff = cutoff ? atol(cutoff) : 16;
+    if (tasks.nworkers <= 1)
+        return;
+
+    tasks.deques = calloc(tasks.nworkers, sizeof(struct epica_deque));
+    if (!tasks.deques) {
+        fprintf(stderr, "epica: out of memory in task runtime\n");
+        exit(1);
+    }
+    /* The thread spawning first becomes worker 0 */
+    task_deque = &tasks.deques[0];
+    task_seed = 1;
+    for (int i = 1; i < tasks.nworkers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, task_worker_thread, (void *)(long)i) != 0) {
+            tasks.nworkers = i;
+            break;
+        }
+        pthread_detach(thread);
+    }
+}
+
+void epica_spawn(struct epica_frame *frame, struct epica_task *task, epica_task_thunk thunk,
+                 long *args, void *result) {
+    pthread_once(&tasks_once, tasks_init);
+
+    /* Below the cutoff spawning costs more than it gains, run serially */
+    if (!task_deque || task_depth >= tasks.cutoff) {
+        task_depth++;
+        thunk(args, result);
+        task_depth--;
+        return;
+    }
+
+    task->thunk = thunk;
+    task->args = args;
+    task->result = result;
+    task->frame = frame;
+    task->depth = task_depth + 1;
+    atomic_fetch_add_explicit(&frame->pending, 1, memory_order_relaxed);
+    if (!deque_push(task_deque, task)) {
+        atomic_fetch_sub_explicit(&frame->pending, 1, memory_order_relaxed);
+        task_depth++;
+        thunk(args, result);
+        task_depth--;
+        return;
+    }
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&tasks.sleepers, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&tasks.lock);
+        tasks.wakeups++;
+        pthread_cond_signal(&tasks.wakeup);
+        pthread_mutex_unlock(&tasks.lock);
+    }
+}
+
+void epica_sync(struct epica_frame *frame) {
+    /* Run our own tasks first, help others while stolen ones finish */
+    while (atomic_load_explicit(&frame->pending, memory_order_acquire) > 0) {
+        struct epica_task *task = deque_pop(task_deque);
+        if (!task)
+            task = task_steal();
+        if (task)
+            task_run(task);
+        else
+            sched_yield();
+    }
+}
+
+/* Profiler for programs compiled with --instrument. Every thread records
+   a calling context tree into its own buffers, so the hooks never take a
+   lock; the buffers are merged into a report when the program exits. */
+struct prof_node {
+    long func;
+    long parent;
+    long first_child;
+    long next_sibling;
+    long calls;
+    unsigned long self;
+};
+
+struct prof_frame {
+    long node;
+    unsigned long start;
+    unsigned long children;
+};
+
+struct prof_thread {
+    struct prof_thread *next;
+    struct prof_node *nodes;
+    long nnodes;
+    long nodes_capacity;
+    struct prof_frame *stack;
+    long depth;
+    long stack_capacity;
+    long *active;          /* activations of each function on the stack */
+    unsigned long *total;  /* cycles of outermost activations */
+    long *loop_entries;
+    long *loop_trips;
+};
+
+static struct {
+    const char **funcs;
+    long nfuncs;
+    const char **loops;
+    long nloops;
+    struct prof_thread *_Atomic threads;
+} prof;
+
+static _Thread_local struct prof_thread *prof_self;
+
+static unsigned long prof_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+#endif
+}
+
+static void *prof_alloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (!ptr) {
+        fprintf(stderr, "epica: out of memory in profiler\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static struct prof_thread *prof_thread_init(void) {
+    struct prof_thread *self = prof_alloc(NULL, sizeof(struct prof_thread));
+    memset(self, 0, sizeof(struct prof_thread));
+    self->active = calloc(prof.nfuncs + 1, sizeof(long));
+    self->total = calloc(prof.nfuncs + 1, sizeof(unsigned long));
+    self->loop_entries = calloc(prof.nloops + 1, sizeof(long));
+    self->loop_trips = calloc(prof.nloops + 1, sizeof(long));
+    if (!self->active || !self->total || !self->loop_entries || !self->loop_trips) {
+        fprintf(stderr, "epica: out of memory in profiler\n");
+        exit(1);
+    }
+
+    /* Node 0 is the root of the tree */
+    self->nodes_capacity = 64;
+    self->nodes = prof_alloc(NULL, self->nodes_capacity * sizeof(struct prof_node));
+    self->nodes[0] = (struct prof_node){.func = -1, .parent = -1, .first_child = -1, .next_sibling = -1};
+    self->nnodes = 1;
+
+    self->next = atomic_load(&prof.threads);
+    while (!atomic_compare_exchange_weak(&prof.threads, &self->next, self))
+        ;
+    prof_self = self;
+    return self;
+}
+
+static long prof_child(struct prof_thread *self, long parent, long func) {
+    long node;
+    for (node = self->nodes[parent].first_child; node >= 0; node = self->nodes[node].next_sibling) {
+        if (self->nodes[node].func == func)
+            return node;
+    }
+
+    if (self->nnodes == self->nodes_capacity) {
+        self->nodes_capacity *= 2;
+        self->nodes = prof_alloc(self->nodes, self->nodes_capacity * sizeof(struct prof_node));
+    }
+    node = self->nnodes++;
+    self->nodes[node] = (struct prof_node){
+        .func = func,
+        .parent = parent,
+        .first_child = -1,
+        .next_sibling = self->nodes[parent].first_child,
+    };
+    self->nodes[parent].first_child = node;
+    return node;
+}
+
+void epica_prof_enter(long func) {
+    struct prof_thread *self = prof_self ? prof_self : prof_thread_init();
+    long parent = self->depth ? self->stack[self->depth - 1].node : 0;
+
+    if (self->depth == self->stack_capacity) {
+        self->stack_capacity = self->stack_capacity ? 2 * self->stack_capacity : 64;
+        self->stack = prof_alloc(self->stack, self->stack_capacity * sizeof(struct prof_frame));
+    }
+    struct prof_frame *frame = &self->stack[self->depth++];
+    frame->node = prof_child(self, parent, func);
+    frame->children = 0;
+    self->active[func]++;
+    frame->start = prof_cycles();
+}
+
+void epica_prof_exit(long func) {
+    unsigned long now = prof_cycles();
+    struct prof_thread *self = prof_self;
+    if (!self || !self->depth)
+        return;
+
+    struct prof_frame *frame = &self->stack[--self->depth];
+    unsigned long elapsed = now - frame->start;
+    struct prof_node *node = &self->nodes[frame->node];
+    node->calls++;
+    node->self += elapsed - frame->children;
+    if (self->depth)
+        self->stack[self->depth - 1].children += elapsed;
+    if (--self->active[func] == 0)
+        self->total[func] += elapsed;
+}
+
+void epica_prof_loop(long loop, long trips) {
+    struct prof_thread *self = prof_self ? prof_self : prof_thread_init();
+    self->loop_entries[loop]++;
+    self->loop_trips[loop] += trips;
+}
+
+static void prof_write_stack(FILE *out, struct prof_thread *self, long node) {
+    if (self->nodes[node].parent > 0) {
+        prof_write_stack(out, self, self->nodes[node].parent);
+        fputc(';', out);
+    }
+    fputs(prof.funcs[self->nodes[node].func], out);
+}
+
+struct prof_edge {
+    long caller;
+    long callee;
+    long calls;
+};
+
+static int prof_edge_compare(const void *a, const void *b) {
+    const struct prof_edge *x = a, *y = b;
+    if (x->caller != y->caller)
+        return x->caller < y->caller ? -1 : 1;
+    return (x->callee > y->callee) - (x->callee < y->callee);
+}
+
+static void prof_report(void) {
+    const char *path = getenv("EPICA_PROFILE");
+    char folded_path[4096];
+    long nfuncs = prof.nfuncs;
+    long nnodes = 0, nedges = 0;
+    FILE *out = NULL, *folded = NULL;
+    struct prof_edge *edges = NULL;
+    long *calls = calloc(nfuncs + 1, sizeof(long));
+    unsigned long *self_cycles = calloc(nfuncs + 1, sizeof(unsigned long));
+    unsigned long *total_cycles = calloc(nfuncs + 1, sizeof(unsigned long));
+    long *loop_entries = calloc(prof.nloops + 1, sizeof(long));
+    long *loop_trips = calloc(prof.nloops + 1, sizeof(long));
+    unsigned long all_cycles = 0;
+
+    /* The call graph is gathered from the edges of the context trees,
+       which are at most as many as their nodes */
+    for (struct prof_thread *t = atomic_load(&prof.threads); t; t = t->next)
+        nnodes += t->nnodes;
+    edges = malloc((nnodes + 1) * sizeof(struct prof_edge));
+
+    if (!path)
+        path = "epica.prof";
+    snprintf(folded_path, sizeof(folded_path), "%s.folded", path);
+    out = fopen(path, "w");
+    folded = fopen(folded_path, "w");
+    if (!out || !folded || !calls || !self_cycles || !total_cycles || !edges || !loop_entries || !loop_trips) {
+        fprintf(stderr, "epica: cannot write profile to %s\n", path);
+        goto cleanup;
+    }
+
+    /* Merge the buffers of all threads, the collapsed stacks are written
+       out right away, one line per context with its self cycles */
+    for (struct prof_thread *t = atomic_load(&prof.threads); t; t = t->next) {
+        for (long i = 1; i < t->nnodes; i++) {
+            struct prof_node *node = &t->nodes[i];
+            calls[node->func] += node->calls;
+            self_cycles[node->func] += node->self;
+            all_cycles += node->self;
+            if (node->parent > 0)
+                edges[nedges++] = (struct prof_edge){t->nodes[node->parent].func, node->func, node->calls};
+            if (node->self) {
+                prof_write_stack(folded, t, i);
+                fprintf(folded, " %lu\n", node->self);
+            }
+        }
+        for (long i = 0; i < nfuncs; i++)
+            total_cycles[i] += t->total[i];
+        for (long i = 0; i < prof.nloops; i++) {
+            loop_entries[i] += t->loop_entries[i];
+            loop_trips[i] += t->loop_trips[i];
+        }
+    }
+
+    fprintf(out, "Flat profile:\n");
+    fprintf(out, "%7s %16s %16s %12s  %s\n", "self%", "self cycles", "total cycles", "calls", "function");
+    for (long i = 0; i < nfuncs; i++) {
+        if (!calls[i])
+            continue;
+        fprintf(out, "%6.2f%% %16lu %16lu %12ld  %s\n",
+                all_cycles ? 100.0 * self_cycles[i] / all_cycles : 0.0,
+                self_cycles[i], total_cycles[i], calls[i], prof.funcs[i]);
+    }
+
+    /* The same edge appears in every context it is called from */
+    fprintf(out, "\nCall graph:\n");
+    fprintf(out, "%12s  %s\n", "calls", "caller -> callee");
+    qsort(edges, nedges, sizeof(struct prof_edge), prof_edge_compare);
+    for (long i = 0; i < nedges;) {
+        long edge_calls = 0;
+        long j = i;
+        for (; j < nedges && edges[j].caller == edges[i].caller && edges[j].callee == edges[i].callee; j++)
+            edge_calls += edges[j].calls;
+        if (edge_calls)
+            fprintf(out, "%12ld  %s -> %s\n", edge_calls, prof.funcs[edges[i].caller], prof.funcs[edges[i].callee]);
+        i = j;
+    }
+
+    fprintf(out, "\nLoops:\n");
+    fprintf(out, "%12s %12s %12s  %s\n", "entries", "trips", "trips/entry", "loop");
+    for (long i = 0; i < prof.nloops; i++) {
+        if (!loop_entries[i])
+            continue;
+        fprintf(out, "%12ld %12ld %12.1f  %s\n",
+                loop_entries[i], loop_trips[i], (double)loop_trips[i] / loop_entries[i], prof.loops[i]);
+    }
+    fprintf(stderr, "epica: profile written to %s and %s\n", path, folded_path);
+
+cleanup:
+    if (out)
+        fclose(out);
+    if (folded)
+        fclose(folded);
+    free(calls);
+    free(self_cycles);
+    free(total_cycles);
+    free(edges);
+    free(loop_entries);
+    free(loop_trips);
+}
+
+/* Called from a constructor of the instrumented program */
+void epica_prof_init(const char **funcs, long nfuncs, const char **loops, long nloops) {
+    prof.funcs = funcs;
+    prof.nfuncs = nfuncs;
+    prof.loops = loops;
+    prof.nloops = nloops;
+    atexit(prof_report);
+}
+
+/* x86-64 microarchitecture level of the running cpu (1 to 4), used to
+   pick a version of multiversioned functions. Called from ifunc
+   resolvers, before constructors have run. */
+long epica_cpu_level(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("sse4.2") || !__builtin_cpu_supports("popcnt") || !__builtin_cpu_supports("ssse3"))
+        return 1;
+    if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("bmi2") || !__builtin_cpu_supports("fma"))
+        return 2;
+    if (!__builtin_cpu_supports("avx512f") || !__builtin_cpu_supports("avx512bw")
+        || !__builtin_cpu_supports("avx512cd") || !__builtin_cpu_supports("avx512dq")
+        || !__builtin_cpu_supports("avx512vl"))
+        return 3;
+    return 4;
+#else
+    return 1;
+#endif
+}
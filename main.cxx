@@ -1,14 +1,31 @@
+#include <algorithm>
 #include <cstdlib>
+#include <format>
+#include <llvm/Config/llvm-config.h>
 #include <llvm/Support/raw_ostream.h>
 #include "main.h"
 #include "semantic_analyser.h"
 #include "codegen_llvm.h"
+#include "jit_llvm.h"
+#include "interpreter.h"
+#include "stream.h"
+#include "specializer.h"
+#include "inliner.h"
+#include "const_evaluator.h"
+#include "error.h"
 
-Driver::Driver() : trace_parsing(false), trace_scanning(false) { }
+Driver::Driver() : trace_parsing(false), trace_scanning(false), root(nullptr) { }
+
+Driver::~Driver() {
+    delete root;
+    Node::arena_release({});
+}
 
 int Driver::parse(const std::string &f) {
     file = f;
-    location.initialize(&file);
+    location.initialize(SourceLoc::add_file(f));
+    if (!root)
+        root = new Program(location);
     scan_begin();
     yy::parser parse(*this);
     parse.set_debug_level(std::getenv("EPICA_DEBUG") ? std::stoi(std::getenv("EPICA_DEBUG")) : 0);
@@ -17,24 +34,192 @@ int Driver::parse(const std::string &f) {
     return result;
 }
 
+bool Driver::add_function(Function *func) {
+    if (on_function)
+        return on_function(func);
+    root->children.emplace_back(func);
+    return true;
+}
+
+bool Driver::add_const(Const *constant) {
+    /* Initializers may call any function, so they need the whole program */
+    if (on_function) {
+        ast_error(std::format("constant {} not supported in streaming compilation", constant->name), constant->loc);
+        return false;
+    }
+    static_cast<Program *>(root)->consts.emplace_back(constant);
+    root->children.emplace_back(constant->init);
+    return true;
+}
+
+static int usage() {
+    std::cerr << "Usage: epica [-v] [--instrument] [--target=<triple>] [--cpu=<cpu>|native] [--features=<features>]"
+              << " [--multiversion] [--no-specialize] [--no-inline] [--stream=<dir> [-O<level>]] <source-file>" << std::endl;
+    std::cerr << "       epica [-v] [--no-specialize] [--no-inline] --lazy [-j <threads>] <source-file>" << std::endl;
+    std::cerr << "       epica [-v] [--no-specialize] [--no-inline] --tiered <source-file>" << std::endl;
+    std::cerr << "       epica --version" << std::endl;
+    return 1;
+}
+
+static Function *find_main(Program *program) {
+    for (Node *child : program->children) {
+        if (static_cast<Function *>(child)->name == "main")
+            return static_cast<Function *>(child);
+    }
+    std::cerr << "no main function to run" << std::endl;
+    return nullptr;
+}
+
+static int run_lazy(Program *program, unsigned compile_threads) {
+    Function *main_func = find_main(program);
+    if (!main_func)
+        return 1;
+
+    /* Nothing is generated up front, every function gets its own module
+       and context once it is first called */
+    std::unordered_map<std::string, Function *> functions;
+    std::vector<std::string> names;
+    for (Node *child : program->children) {
+        Function *func = static_cast<Function *>(child);
+        if (func->reachable) {
+            functions.insert({CodegenLLVM::symbol_name(func), func});
+            names.emplace_back(CodegenLLVM::symbol_name(func));
+        }
+    }
+    auto generate = [program, &functions](const std::string &name) {
+        CodegenLLVM codegen(program);
+        std::unique_ptr<llvm::Module> mod(codegen.compile_function(functions.at(name)));
+        return llvm::orc::ThreadSafeModule(std::move(mod), codegen.take_context());
+    };
+
+    JitLLVM jit;
+    if (!jit.initialize(compile_threads) || !jit.add_lazy_functions(names, generate))
+        return 1;
+
+    /* Functions called directly from main are likely needed soon */
+    if (compile_threads > 0) {
+        std::vector<std::string> callees;
+        for (Function *callee : main_func->callees)
+            callees.emplace_back(CodegenLLVM::symbol_name(callee));
+        jit.precompile(callees);
+    }
+
+    long result;
+    if (!jit.run("main", result))
+        return 1;
+    return main_func->type == Type::Void ? 0 : static_cast<int>(result);
+}
+
+static int run_tiered(Program *program) {
+    Function *main_func = find_main(program);
+    if (!main_func)
+        return 1;
+
+    for (Node *child : program->children) {
+        if (static_cast<Function *>(child)->reachable && !Interpreter::supports(child))
+            return 1;
+    }
+
+    const char *threshold = std::getenv("EPICA_TIER_THRESHOLD");
+    /* Note: a threshold of 0 would turn tiering off */
+    Interpreter interpreter(program, threshold ? std::max(std::stol(threshold), 1l) : 1000);
+    long result = interpreter.run(main_func);
+    return main_func->type == Type::Void ? 0 : static_cast<int>(result);
+}
+
 int main(int argc, char **argv) {
     Driver driver;
+    bool verbose = false;
+    bool lazy = false;
+    bool tiered = false;
+    bool instrument = false;
+    bool multiversion = false;
+    bool specialize = true;
+    bool inline_calls = true;
+    std::string target, cpu, features;
+    std::string stream_dir;
+    int opt_level = 2;
+    unsigned compile_threads = 0;
 
-    if (argc != 2) {
-        std::cerr << "Usage: epica <source-file>" << std::endl;
-        return 1;
+    if (argc < 2)
+        return usage();
+    if (argc == 2 && std::string(argv[1]) == "--version") {
+        std::cout << "epica, LLVM " << LLVM_VERSION_STRING << std::endl;
+        return 0;
+    }
+    for (int i = 1; i < argc - 1; i++) {
+        std::string arg = argv[i];
+        if (arg == "-v")
+            verbose = true;
+        else if (arg == "--lazy")
+            lazy = true;
+        else if (arg == "--tiered")
+            tiered = true;
+        else if (arg == "--instrument")
+            instrument = true;
+        else if (arg == "--multiversion")
+            multiversion = true;
+        else if (arg == "--no-specialize")
+            specialize = false;
+        else if (arg == "--no-inline")
+            inline_calls = false;
+        else if (arg.starts_with("--target="))
+            target = arg.substr(9);
+        else if (arg.starts_with("--cpu="))
+            cpu = arg.substr(6);
+        else if (arg.starts_with("--features="))
+            features = arg.substr(11);
+        else if (arg.starts_with("--stream="))
+            stream_dir = arg.substr(9);
+        else if (arg.size() == 3 && arg.starts_with("-O") && arg[2] >= '0' && arg[2] <= '3')
+            opt_level = arg[2] - '0';
+        else if (arg == "-j" && i + 1 < argc - 1)
+            compile_threads = std::stoi(argv[++i]);
+        else
+            return usage();
+    }
+    /* The profiler reports at exit of an AOT compiled program and the JIT
+       always compiles for the host */
+    bool target_options = !target.empty() || !cpu.empty() || !features.empty() || multiversion;
+    if ((instrument || target_options) && (lazy || tiered))
+        return usage();
+    /* Profiler ids are numbered per module, so it needs the whole program */
+    if (!stream_dir.empty() && (instrument || lazy || tiered))
+        return usage();
+
+    if (!stream_dir.empty()) {
+        CodegenLLVM target_config(nullptr);
+        if (!target_config.set_target(target, cpu, features, multiversion))
+            return 1;
+        StreamCompiler stream(driver, stream_dir, opt_level, verbose, target_config.get_target(), multiversion);
+        return stream.run(argv[argc - 1]) ? 0 : 1;
     }
 
-    if (driver.parse(argv[1]))
+    if (driver.parse(argv[argc - 1]))
         return 1;
 
-    SemanticAnalyser semantic_analyser(static_cast<Program *>(driver.root));
+    SemanticAnalyser semantic_analyser(static_cast<Program *>(driver.root), verbose);
     if (!semantic_analyser.analyse())
         return 1;
+    if (!ConstEvaluator(static_cast<Program *>(driver.root), verbose).run())
+        return 1;
+    /* The profile reports functions as written */
+    if (specialize && !instrument)
+        Specializer(static_cast<Program *>(driver.root), verbose).run();
+    if (inline_calls && !instrument)
+        Inliner(static_cast<Program *>(driver.root), verbose).run();
+
+    if (tiered) {
+        return run_tiered(static_cast<Program *>(driver.root));
+    }
+
+    if (lazy) {
+        return run_lazy(static_cast<Program *>(driver.root), compile_threads);
+    }
 
-    CodegenLLVM codegen(static_cast<Program *>(driver.root));
+    CodegenLLVM codegen(static_cast<Program *>(driver.root), instrument);
+    if (!codegen.set_target(target, cpu, features, multiversion))
+        return 1;
     llvm::Module *mod = codegen.compile();
     llvm::outs() << *mod << "\n";
-
-    delete driver.root;
 }
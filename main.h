@@ -1,6 +1,7 @@
 #ifndef EPICA_MAIN_H
 #define EPICA_MAIN_H
 
+#include <functional>
 #include <string>
 #include <map>
 #include "ast.h"
@@ -12,7 +13,10 @@ YY_DECL;
 class Driver {
 public:
     Driver();
+    ~Driver();
     int parse(const std::string &f);
+    bool add_function(Function *func);
+    bool add_const(Const *constant);
     void scan_begin();
     void scan_end();
 
@@ -20,8 +24,11 @@ public:
     bool trace_parsing;
     bool trace_scanning;
     int result;
-    Node *root;
+    Node *root; /* deleted with the driver, which releases the node arena */
     yy::location location;
+    /* If set, functions are handed over as soon as they are parsed instead
+       of being added to root */
+    std::function<bool(Function *)> on_function;
 };
 
 #endif //EPICA_MAIN_H
@@ -36,20 +36,43 @@
     ELSE        "else"
     WHILE       "while"
     DO          "do"
+    FOR         "for"
+    STEP        "step"
+    CASE        "case"
+    OF          "of"
     COMMENCE    "commence"
     END         "end"
     VAR         "var"
+    MEMO        "memo"
+    HOT         "hot"
+    INLINE      "inline"
+    NOINLINE    "noinline"
+    LIKELY      "likely"
+    UNLIKELY    "unlikely"
+    PARALLEL    "parallel"
+    TO          "to"
+    REDUCE      "reduce"
+    SPAWN       "spawn"
+    SYNC        "sync"
+    CONST       "const"
 
     LPAREN      "("
     RPAREN      ")"
+    LBRACKET    "["
+    RBRACKET    "]"
     COMMA       ","
     ASSIGN      ":="
+    COLON       ":"
+    SEMICOLON   ";"
     LOR         "|"
     LAND        "&"
     LXOR        "^"
     OR          "or"
     XOR         "xor"
     AND         "and"
+    SHL         "shl"
+    SHR         "shr"
+    SAR         "sar"
     EQ          "="
     ADD         "+"
     MULT        "*"
@@ -60,6 +83,8 @@
 
 %type <Node *> program;
 %type <Function *> function;
+%type <Const *> constant;
+%type <long> bound;
 %type <std::vector<Parameter> *> parameters;
 %type <Parameter> parameter;
 %type <Block *> block;
@@ -70,22 +95,46 @@
 %type <std::vector<Expression *> *> arguments;
 %type <If *> if;
 %type <While *> while;
+%type <BranchHint> hint;
+%type <For *> for;
+%type <Case *> case;
+%type <std::vector<CaseArm> *> arms;
+%type <CaseArm> arm;
+%type <Parallel *> parallel;
+%type <BinOpKind> reduction;
 %type <Call *> call;
-%type <Expression *> expression simple literal logical_or logical_xor logical_and or xor and equality relation add multiply;
+%type <Spawn *> spawn;
+%type <Sync *> sync;
+%type <Expression *> expression simple literal logical_or logical_xor logical_and or xor and equality relation shift add multiply;
 %type <Identifier *> variable;
 %type <CallExpr *> call_expr;
 %type <Integer *> integer;
 %type <Boolean *> bool;
 
-%left LOR LAND LXOR OR XOR AND EQ REL ADD MULT SUB
+%left LOR LAND LXOR OR XOR AND EQ REL SHL SHR SAR ADD MULT SUB
 %right THEN ELSE /* to avoid nested if-else SR conflict */
 
 %%
 
 %start program;
-program: program function { $1->children.emplace_back($2); $$ = $1; }
-         | function       { drv.root = $$ = new Program(@$); $$->children.emplace_back($1); }
+program: program function { if (!drv.add_function($2)) YYABORT; $$ = $1; }
+         | program constant { if (!drv.add_const($2)) YYABORT; $$ = $1; }
+         | function         { if (!drv.add_function($1)) YYABORT; $$ = drv.root; }
+         | constant         { if (!drv.add_const($1)) YYABORT; $$ = drv.root; }
          ;
+/* The initializer becomes the body of a function of the index, integer
+   tables are computed in int and checked to fit when evaluated */
+constant: CONST TYPE IDENT "[" IDENT ":=" bound TO bound "]" ":=" expression {
+            Type type = type_from_string($2);
+            Block *body = new Block({new Call("return", {$12}, @12)}, @12);
+            Function *init = new Function(type == Type::Bool ? Type::Bool : Type::Int, $3 + ".init",
+                                          {{Type::Int, $5}}, body, @$);
+            $$ = new Const(type, $3, $7, $9, init, @$);
+          }
+          ;
+bound: INT       { $$ = std::stol($1); }
+       | "-" INT { $$ = -std::stol($2); }
+       ;
 function: TYPE IDENT "(" parameters ")" block  {
             $$ = new Function(type_from_string($1), $2, *$4, $6, @$);
             delete $4;
@@ -93,6 +142,40 @@ function: TYPE IDENT "(" parameters ")" block  {
           | TYPE IDENT "(" ")" block {
             $$ = new Function(type_from_string($1), $2, {}, $5, @$);
           }
+          | MEMO function             {
+            if ($2->memo) {
+                error(@1, "function declared memo more than once");
+                YYABORT;
+            }
+            $2->memo = true;
+            $$ = $2;
+          }
+          | MEMO "(" INT ")" function {
+            if ($5->memo) {
+                error(@1, "function declared memo more than once");
+                YYABORT;
+            }
+            $5->memo = true;
+            $5->memo_capacity = std::stoi($3);
+            $$ = $5;
+          }
+          | HOT function              { $2->hot = true; $$ = $2; }
+          | INLINE function           {
+            if ($2->inline_hint == InlineHint::Never) {
+                error(@1, "function cannot be both inline and noinline");
+                YYABORT;
+            }
+            $2->inline_hint = InlineHint::Always;
+            $$ = $2;
+          }
+          | NOINLINE function         {
+            if ($2->inline_hint == InlineHint::Always) {
+                error(@1, "function cannot be both inline and noinline");
+                YYABORT;
+            }
+            $2->inline_hint = InlineHint::Never;
+            $$ = $2;
+          }
           ;
 parameters: parameters "," parameter { $1->emplace_back($3); $$ = $1; }
             | parameter              { $$ = new std::vector<Parameter>; $$->emplace_back($1); }
@@ -114,21 +197,67 @@ statement: block         { $$ = static_cast<Statement *>($1); }
            | assignment  { $$ = static_cast<Statement *>($1); }
            | if          { $$ = static_cast<Statement *>($1); }
            | while       { $$ = static_cast<Statement *>($1); }
+           | for         { $$ = static_cast<Statement *>($1); }
+           | case        { $$ = static_cast<Statement *>($1); }
+           | parallel    { $$ = static_cast<Statement *>($1); }
            | call        { $$ = static_cast<Statement *>($1); }
+           | spawn       { $$ = static_cast<Statement *>($1); }
+           | sync        { $$ = static_cast<Statement *>($1); }
            ;
 declaration: VAR TYPE IDENT { $$ = new Variable(type_from_string($2), $3, @$); }
              ;
 assignment: IDENT ":=" expression { $$ = new Assignment($1, $3, @$); }
             ;
+spawn: IDENT ":=" SPAWN call_expr { $$ = new Spawn($1, $4, @$); }
+       | SPAWN call_expr          { $$ = new Spawn("", $2, @$); }
+       ;
+sync: SYNC { $$ = new Sync(@$); }
+      ;
 arguments: arguments "," expression { $1->emplace_back($3); $$ = $1; }
            | expression             { $$ = new std::vector<Expression *>; $$->emplace_back($1); }
            ;
 
-if: IF expression THEN statement                  { $$ = new If($2, $4, @$); }
-    | IF expression THEN statement ELSE statement { $$ = new If($2, $4, $6, @$); }
+if: IF hint expression THEN statement                  { $$ = new If($3, $5, @$); $$->hint = $2; }
+    | IF hint expression THEN statement ELSE statement { $$ = new If($3, $5, $7, @$); $$->hint = $2; }
     ;
-while: WHILE expression DO statement { $$ = new While($2, $4, @$); }
+while: WHILE hint expression DO statement { $$ = new While($3, $5, @$); $$->hint = $2; }
        ;
+hint: %empty     { $$ = BranchHint::None; }
+      | LIKELY   { $$ = BranchHint::Likely; }
+      | UNLIKELY { $$ = BranchHint::Unlikely; }
+      ;
+for: FOR IDENT ":=" expression TO expression DO statement {
+       $$ = new For(new Variable(Type::Int, $2, @2), $4, $6, nullptr, $8, @$);
+     }
+     | FOR IDENT ":=" expression TO expression STEP expression DO statement {
+       $$ = new For(new Variable(Type::Int, $2, @2), $4, $6, $8, $10, @$);
+     }
+     ;
+case: CASE expression OF arms END                    { $$ = new Case($2, *$4, nullptr, @$); delete $4; }
+      | CASE expression OF arms ";" END              { $$ = new Case($2, *$4, nullptr, @$); delete $4; }
+      | CASE expression OF arms ELSE statement END     { $$ = new Case($2, *$4, $6, @$); delete $4; }
+      | CASE expression OF arms ";" ELSE statement END { $$ = new Case($2, *$4, $7, @$); delete $4; }
+      ;
+arms: arms ";" arm { $1->emplace_back($3); $$ = $1; }
+      | arm        { $$ = new std::vector<CaseArm>; $$->emplace_back($1); }
+      ;
+arm: arguments ":" statement {
+       $$ = {*$1, $3};
+       delete $1;
+     }
+     ;
+parallel: PARALLEL IDENT ":=" expression TO expression DO statement {
+            $$ = new Parallel(new Variable(Type::Int, $2, @2), $4, $6, $8, @$);
+          }
+          | PARALLEL IDENT ":=" expression TO expression REDUCE reduction IDENT DO statement {
+            $$ = new Parallel(new Variable(Type::Int, $2, @2), $4, $6, $8, $9, $11, @$);
+          }
+          ;
+reduction: "+"     { $$ = BinOpKind::Add; }
+           | "*"   { $$ = BinOpKind::Mult; }
+           | "and" { $$ = BinOpKind::And; }
+           | "or"  { $$ = BinOpKind::Or; }
+           ;
 call: IDENT "(" arguments ")" {
         $$ = new Call($1, *$3, @$);
         delete $3;
@@ -141,10 +270,12 @@ expression: logical_or { $$ = static_cast<Expression *>($1); }
 simple: literal              { $$ = $1; }
         | variable           { $$ = static_cast<Expression *>($1); }
         | call_expr          { $$ = static_cast<Expression *>($1); }
+        | IDENT "[" expression "]" { $$ = static_cast<Expression *>(new Index($1, $3, @$)); }
         | "-" simple         { $$ = static_cast<Expression *>(new UnOp(UnOpKind::Neg, $2, @$)); }
         | NOT simple         { $$ = static_cast<Expression *>(new UnOp(UnOpKind::Not, $2, @$)); }
         | "!" simple         { $$ = static_cast<Expression *>(new UnOp(UnOpKind::LogNot, $2, @$)); }
         | "(" expression ")" { $$ = $2; }
+        | TYPE "(" expression ")" { $$ = static_cast<Expression *>(new CallExpr($1, {$3}, @$)); }
         ;
 literal: integer { $$ = static_cast<Expression *>($1); }
          | bool  { $$ = static_cast<Expression *>($1); }
@@ -184,9 +315,14 @@ and: equality             { $$ = $1; }
 equality: relation                { $$ = $1; }
           | equality "=" relation { $$ = static_cast<Expression *>(new BinOp(BinOpKind::Eq, $1, $3, @$)); }
           ;
-relation: add                { $$ = $1; }
-          | relation REL add { $$ = static_cast<Expression *>(new BinOp(resolve_relation_operator($2), $1, $3, @$)); }
+relation: shift                { $$ = $1; }
+          | relation REL shift { $$ = static_cast<Expression *>(new BinOp(resolve_relation_operator($2), $1, $3, @$)); }
           ;
+shift: add               { $$ = $1; }
+       | shift "shl" add { $$ = static_cast<Expression *>(new BinOp(BinOpKind::Shl, $1, $3, @$)); }
+       | shift "shr" add { $$ = static_cast<Expression *>(new BinOp(BinOpKind::Shr, $1, $3, @$)); }
+       | shift "sar" add { $$ = static_cast<Expression *>(new BinOp(BinOpKind::Sar, $1, $3, @$)); }
+       ;
 add: multiply            { $$ = $1; }
      | add "+" multiply { $$ = static_cast<Expression *>(new BinOp(BinOpKind::Add, $1, $3, @$)); }
      | add "-" multiply { $$ = static_cast<Expression *>(new BinOp(BinOpKind::Sub, $1, $3, @$)); }
@@ -1,12 +1,133 @@
+#include <algorithm>
 #include <cassert>
+#include <climits>
 #include <format>
 #include <sstream>
 #include "semantic_analyser.h"
 #include "error.h"
 
-SemanticAnalyser::SemanticAnalyser(Program *program) : program(program) {}
+/* Constant tables are evaluated entry by entry and kept in memory */
+static const long max_const_entries = 1l << 20;
+
+/* Integer operands of different widths are widened to the wider one.
+   Vector operands may be mixed with integer ones, which are then broadcast
+   to all lanes. Returns the type of the lane-wise result, or none. */
+static Type lanewise_type(Type left, Type right) {
+    if (type_bits(left) && type_bits(right))
+        return type_bits(left) >= type_bits(right) ? left : right;
+    if (left == right && type_lanes(left))
+        return left;
+    if (type_bits(left) && type_lanes(right))
+        return right;
+    if (type_lanes(left) && type_bits(right))
+        return left;
+    return Type::None;
+}
+
+static bool literal_fits(Expression *expr, Type type) {
+    if (expr->kind != ExpressionKind::Integer || !type_bits(type))
+        return false;
+    long value = static_cast<Integer *>(expr)->value;
+    long limit = type_bits(type) < 64 ? 1l << (type_bits(type) - 1) : LONG_MAX;
+    return value >= -limit && value < limit;
+}
+
+/* Integer literals take the type of the other operand if they fit, so that
+   e.g. c + 1 stays a char */
+static void adapt_literal(Expression *expr, Type type) {
+    if (type_bits(type) && literal_fits(expr, type))
+        expr->type = type;
+}
+
+/* Integers are widened implicitly, narrowing needs an explicit conversion
+   unless the value is a literal which fits */
+static bool converts(Expression *expr, Type type) {
+    if (expr->type == type)
+        return true;
+    if (type_bits(expr->type) && type_bits(type) && type_bits(expr->type) <= type_bits(type))
+        return true;
+    return literal_fits(expr, type);
+}
+
+/* A declared outcome of a predicate which cannot change is a mistake */
+static bool check_hint(BranchHint hint, Expression *pred) {
+    if ((hint == BranchHint::Likely || hint == BranchHint::Unlikely) && pred->kind == ExpressionKind::Boolean) {
+        ast_error(std::format("{} on a constant predicate", hint == BranchHint::Likely ? "likely" : "unlikely"),
+                  pred->loc);
+        return false;
+    }
+    return true;
+}
+
+/* Static prediction where nothing is declared: a branch leaving the
+   function early is an error or base case, the other one is taken */
+static BranchHint guess_hint(If *i) {
+    bool positive_returns = always_returns(i->positive);
+    bool negative_returns = i->negative && always_returns(i->negative);
+    if (positive_returns && !negative_returns)
+        return BranchHint::GuessedUnlikely;
+    if (negative_returns && !positive_returns)
+        return BranchHint::GuessedLikely;
+    return BranchHint::None;
+}
+
+static bool reads_variable(Node *node, const std::string &name) {
+    if (node->kind == NodeKind::Expression && static_cast<Expression *>(node)->kind == ExpressionKind::Identifier
+        && static_cast<Identifier *>(node)->name == name)
+        return true;
+    return std::any_of(node->children.begin(), node->children.end(), [&name](Node *child) {
+        return reads_variable(child, name);
+    });
+}
+
+/* Chunks of a parallel loop start from the identity and their results are
+   combined afterwards, which only computes the same as running in order if
+   every update is v := v <op> expr, with expr not reading v, and v is not
+   read anywhere else in the loop */
+static bool check_reduction(Parallel *par, Assignment *assignment) {
+    static const std::unordered_map<BinOpKind, const char *> ops = {
+        {BinOpKind::Add, "+"}, {BinOpKind::Mult, "*"}, {BinOpKind::And, "and"}, {BinOpKind::Or, "or"}};
+    Expression *expr = assignment->expr;
+    BinOp *binop = expr->kind == ExpressionKind::BinOp ? static_cast<BinOp *>(expr) : nullptr;
+    if (!binop || binop->kind != par->reduction_kind
+        || binop->left->kind != ExpressionKind::Identifier
+        || static_cast<Identifier *>(binop->left)->name != par->reduction_var
+        || reads_variable(binop->right, par->reduction_var)) {
+        ast_error(std::format("reduction variable {0} can only be updated as {0} := {0} {1} expression, "
+                              "with the expression not reading {0}",
+                              par->reduction_var, ops.at(par->reduction_kind)), assignment->loc);
+        return false;
+    }
+    return true;
+}
+
+SemanticAnalyser::SemanticAnalyser(Program *program, bool verbose)
+    : program(program), current_parallel(nullptr), reduction_operand(nullptr), verbose(verbose) {}
 
 bool SemanticAnalyser::scan_functions() {
+    /* Constants first, the names of their initializers derive from theirs */
+    for (Const *constant : program->consts) {
+        auto existing_const = const_map.find(constant->name);
+        if (existing_const != const_map.end()) {
+            std::stringstream loc_stream;
+            loc_stream << existing_const->second->loc;
+            ast_error(std::format("constant {} redefined (previous definition: {})",
+                                  constant->name, loc_stream.str()), constant->loc);
+            return false;
+        }
+        if (!type_bits(constant->type) && constant->type != Type::Bool) {
+            ast_error(std::format("constant {} is of type {}, integer or bool expected",
+                                  constant->name, type_to_string(constant->type)), constant->loc);
+            return false;
+        }
+        if (constant->from > constant->to || constant->to - constant->from >= max_const_entries) {
+            ast_error(std::format("constant {} must have between 1 and {} entries", constant->name, max_const_entries),
+                      constant->loc);
+            return false;
+        }
+        const_map.insert({constant->name, constant});
+    }
+
     for (Node *child : program->children) {
         assert(child->kind == NodeKind::Function);
         Function *func = static_cast<Function *>(child);
@@ -18,6 +139,11 @@ bool SemanticAnalyser::scan_functions() {
                                            func->name, loc_stream.str()), func->loc);
             return false;
         }
+        /* Calls by that name would resolve to the builtin */
+        if (is_builtin(func->name)) {
+            ast_error(std::format("function {} has the name of a builtin", func->name), func->loc);
+            return false;
+        }
         function_map.insert({func->name, func});
     }
     return true;
@@ -32,6 +158,8 @@ bool SemanticAnalyser::resolve_types(Node *node) {
             current_func = static_cast<Function *>(node);
             current_vars.clear();
             current_params.clear();
+            pending_spawns.clear();
+            loop_vars.clear();
             for (Parameter &param : current_func->params)
                 current_params.insert({param.name, param});
             break;
@@ -58,6 +186,29 @@ bool SemanticAnalyser::resolve_types(Node *node) {
                     return false;
                 }
                 current_vars.insert({var->name, var});
+            } else if (statement->kind == StatementKind::For) {
+                /* Declared by its Variable child, read-only in the body */
+                loop_vars.emplace_back(static_cast<For *>(statement)->var->name);
+            } else if (statement->kind == StatementKind::Parallel) {
+                Parallel *par = static_cast<Parallel *>(statement);
+                if (current_parallel) {
+                    ast_error("nested parallel loops are not supported", par->loc);
+                    return false;
+                }
+                /* Everything visible before the loop is shared between iterations */
+                current_parallel = par;
+                parallel_captured.clear();
+                for (auto &[name, var] : current_vars)
+                    parallel_captured.insert(name);
+                for (auto &[name, param] : current_params)
+                    parallel_captured.insert(name);
+            } else if (statement->kind == StatementKind::Assignment && current_parallel
+                       && static_cast<Assignment *>(statement)->var_name == current_parallel->reduction_var) {
+                /* Checked before the operands, the only read of the variable allowed */
+                Assignment *assignment = static_cast<Assignment *>(statement);
+                if (!check_reduction(current_parallel, assignment))
+                    return false;
+                reduction_operand = static_cast<Identifier *>(static_cast<BinOp *>(assignment->expr)->left);
             }
             break;
         }
@@ -66,7 +217,27 @@ bool SemanticAnalyser::resolve_types(Node *node) {
             ;
     }
 
+    /* Spawns pending after either branch of an if (any arm of a case)
+       stay pending after it */
+    std::vector<Spawn *> spawns_before = pending_spawns;
+    std::vector<Spawn *> spawns_positive;
+    bool case_branch = false;
     for (Node *child : node->children) {
+        if (node->kind == NodeKind::Statement && static_cast<Statement *>(node)->kind == StatementKind::If
+            && child == static_cast<If *>(node)->negative) {
+            spawns_positive = pending_spawns;
+            pending_spawns = spawns_before;
+        }
+        if (node->kind == NodeKind::Statement && static_cast<Statement *>(node)->kind == StatementKind::Case
+            && child->kind == NodeKind::Statement) {
+            for (Spawn *spawn : pending_spawns) {
+                if (case_branch
+                    && std::find(spawns_positive.begin(), spawns_positive.end(), spawn) == spawns_positive.end())
+                    spawns_positive.emplace_back(spawn);
+            }
+            case_branch = true;
+            pending_spawns = spawns_before;
+        }
         if (!resolve_types(child))
             return false;
     }
@@ -84,7 +255,25 @@ bool SemanticAnalyser::resolve_types(Node *node) {
                                               type_to_string(wh->pred->type)), wh->loc);
                         return false;
                     }
-                    break;
+                    if (!check_hint(wh->hint, wh->pred))
+                        return false;
+                    goto loop_spawns;
+                }
+                case StatementKind::For: {
+                    For *f = static_cast<For *>(statement);
+                    if (!type_bits(f->from->type) || !type_bits(f->to->type)) {
+                        ast_error("for loop bounds must be integers", f->loc);
+                        return false;
+                    }
+                    /* The direction and trip count have to be known on entry */
+                    if (f->step && (f->step->kind != ExpressionKind::Integer
+                                    || static_cast<Integer *>(f->step)->value == 0)) {
+                        ast_error("for loop step must be a non-zero integer literal", f->step->loc);
+                        return false;
+                    }
+                    loop_vars.pop_back();
+                    current_vars.erase(f->var->name);
+                    goto loop_spawns;
                 }
                 case StatementKind::If: {
                     If *i = static_cast<If *>(statement);
@@ -93,10 +282,115 @@ bool SemanticAnalyser::resolve_types(Node *node) {
                                               type_to_string(i->pred->type)), i->loc);
                         return false;
                     }
+                    if (!check_hint(i->hint, i->pred))
+                        return false;
+                    if (i->hint == BranchHint::None)
+                        i->hint = guess_hint(i);
+                    for (Spawn *spawn : i->negative ? spawns_positive : spawns_before) {
+                        if (std::find(pending_spawns.begin(), pending_spawns.end(), spawn) == pending_spawns.end())
+                            pending_spawns.emplace_back(spawn);
+                    }
                     break;
                 }
+                case StatementKind::Case: {
+                    Case *c = static_cast<Case *>(statement);
+                    if (!type_bits(c->expr->type)) {
+                        ast_error(std::format("case expression is of type {}, integer expected",
+                                              type_to_string(c->expr->type)), c->loc);
+                        return false;
+                    }
+                    std::unordered_map<int, Expression *> labels;
+                    for (CaseArm &arm : c->arms) {
+                        for (Expression *label : arm.labels) {
+                            if (label->kind != ExpressionKind::Integer) {
+                                ast_error("case label must be an integer literal", label->loc);
+                                return false;
+                            }
+                            if (!literal_fits(label, c->expr->type)) {
+                                ast_error(std::format("case label {} is out of range of {}",
+                                                      static_cast<Integer *>(label)->value,
+                                                      type_to_string(c->expr->type)), label->loc);
+                                return false;
+                            }
+                            label->type = c->expr->type;
+                            auto [existing, inserted] = labels.insert({static_cast<Integer *>(label)->value, label});
+                            if (!inserted) {
+                                std::stringstream loc_stream;
+                                loc_stream << existing->second->loc;
+                                ast_error(std::format("duplicate case label {} (previous label: {})",
+                                                      existing->first, loc_stream.str()), label->loc);
+                                return false;
+                            }
+                        }
+                    }
+                    for (Spawn *spawn : spawns_positive) {
+                        if (std::find(pending_spawns.begin(), pending_spawns.end(), spawn) == pending_spawns.end())
+                            pending_spawns.emplace_back(spawn);
+                    }
+                    /* Without else, no arm may be taken */
+                    if (!c->otherwise) {
+                        for (Spawn *spawn : spawns_before) {
+                            if (std::find(pending_spawns.begin(), pending_spawns.end(), spawn) == pending_spawns.end())
+                                pending_spawns.emplace_back(spawn);
+                        }
+                    }
+                    break;
+                }
+                case StatementKind::Parallel: {
+                    Parallel *par = static_cast<Parallel *>(statement);
+                    if (!type_bits(par->from->type) || !type_bits(par->to->type)) {
+                        ast_error("parallel loop bounds must be integers", par->loc);
+                        return false;
+                    }
+                    if (!par->reduction_var.empty()) {
+                        auto variable = current_vars.find(par->reduction_var);
+                        if (!parallel_captured.contains(par->reduction_var) || variable == current_vars.end()) {
+                            ast_error(std::format("reduction variable {} must be a variable declared before "
+                                                  "the parallel loop", par->reduction_var), par->loc);
+                            return false;
+                        }
+                        if (variable->second->type != Type::Int) {
+                            ast_error(std::format("reduction variable {} is of type {}, int expected",
+                                                  par->reduction_var,
+                                                  type_to_string(variable->second->type)), par->loc);
+                            return false;
+                        }
+                    }
+                    /* Variables declared in the loop are private to the outlined body */
+                    std::erase_if(current_vars, [this](auto &entry) {
+                        return !parallel_captured.contains(entry.first);
+                    });
+                    current_parallel = nullptr;
+                    goto loop_spawns;
+                }
+                loop_spawns:
+                    /* Task slots are reused by the next iteration */
+                    for (Spawn *spawn : pending_spawns) {
+                        if (std::find(spawns_before.begin(), spawns_before.end(), spawn) == spawns_before.end()) {
+                            ast_error("spawn inside loop must be synced in the same iteration", spawn->loc);
+                            return false;
+                        }
+                    }
+                    break;
                 case StatementKind::Assignment: {
                     Assignment *assignment = static_cast<Assignment *>(statement);
+                    if (current_parallel && (assignment->var_name == current_parallel->var->name
+                                             || (parallel_captured.contains(assignment->var_name)
+                                                 && assignment->var_name != current_parallel->reduction_var))) {
+                        ast_error(std::format("cannot assign to {} inside parallel loop",
+                                              assignment->var_name), assignment->loc);
+                        return false;
+                    }
+                    if (std::find(loop_vars.begin(), loop_vars.end(), assignment->var_name) != loop_vars.end()) {
+                        ast_error(std::format("cannot assign to loop variable {}", assignment->var_name),
+                                  assignment->loc);
+                        return false;
+                    }
+                    if (pending_spawn(assignment->var_name)) {
+                        ast_error(std::format("assigning to {} before sync of the spawn assigning it",
+                                              assignment->var_name), assignment->loc);
+                        return false;
+                    }
                     auto variable = current_vars.find(assignment->var_name);
                     auto parameter = current_params.find(assignment->var_name);
                     Type type;
@@ -109,11 +403,12 @@ bool SemanticAnalyser::resolve_types(Node *node) {
                                               assignment->var_name), assignment->loc);
                         return false;
                     }
-                    if (type != assignment->expr->type) {
+                    if (!converts(assignment->expr, type)) {
                         ast_error(std::format("assigning {} to {}, which is of type {}",
                                               type_to_string(assignment->expr->type), assignment->var_name,
                                               type_to_string(type)),
                                   assignment->loc);
+                        return false;
                     }
                     break;
                 }
@@ -123,6 +418,62 @@ bool SemanticAnalyser::resolve_types(Node *node) {
                         return false;
                     break;
                 }
+                case StatementKind::Spawn: {
+                    Spawn *spawn = static_cast<Spawn *>(statement);
+                    if (!spawn->call->func) {
+                        ast_error(std::format("builtin {} cannot be spawned", spawn->call->func_name), spawn->loc);
+                        return false;
+                    }
+                    /* Arguments and results of spawned calls are passed as single words */
+                    Function *spawned = spawn->call->func;
+                    if (type_lanes(spawned->type)
+                        || std::any_of(spawned->params.begin(), spawned->params.end(),
+                                       [](Parameter &param) { return type_lanes(param.type) != 0; })) {
+                        ast_error(std::format("function {} takes or returns a vector, it cannot be spawned",
+                                              spawned->name), spawn->loc);
+                        return false;
+                    }
+                    if (!spawn->var_name.empty()) {
+                        auto variable = current_vars.find(spawn->var_name);
+                        auto parameter = current_params.find(spawn->var_name);
+                        Type type;
+                        if (variable != current_vars.end()) {
+                            type = variable->second->type;
+                        } else if (parameter != current_params.end()) {
+                            type = parameter->second.type;
+                        } else {
+                            ast_error(std::format("identifier {} undeclared", spawn->var_name), spawn->loc);
+                            return false;
+                        }
+                        if (type != spawn->call->type) {
+                            ast_error(std::format("assigning {} to {}, which is of type {}",
+                                                  type_to_string(spawn->call->type), spawn->var_name,
+                                                  type_to_string(type)),
+                                      spawn->loc);
+                            return false;
+                        }
+                        if (current_parallel && parallel_captured.contains(spawn->var_name)) {
+                            ast_error(std::format("cannot assign to {} inside parallel loop",
+                                                  spawn->var_name), spawn->loc);
+                            return false;
+                        }
+                        if (std::find(loop_vars.begin(), loop_vars.end(), spawn->var_name) != loop_vars.end()) {
+                            ast_error(std::format("cannot assign to loop variable {}", spawn->var_name),
+                                      spawn->loc);
+                            return false;
+                        }
+                        if (pending_spawn(spawn->var_name)) {
+                            ast_error(std::format("assigning to {} before sync of the spawn assigning it",
+                                                  spawn->var_name), spawn->loc);
+                            return false;
+                        }
+                    }
+                    pending_spawns.emplace_back(spawn);
+                    break;
+                }
+                case StatementKind::Sync:
+                    pending_spawns.clear();
+                    break;
                 default:
                     ;
             }
@@ -144,6 +495,43 @@ bool SemanticAnalyser::resolve_types(Node *node) {
                                               ident->name), ident->loc);
                         return false;
                     }
+                    if (pending_spawn(ident->name)) {
+                        ast_error(std::format("{} read before sync of the spawn assigning it",
+                                              ident->name), ident->loc);
+                        return false;
+                    }
+                    if (current_parallel && ident->name == current_parallel->reduction_var
+                        && ident != reduction_operand) {
+                        ast_error(std::format("reduction variable {} read inside parallel loop, "
+                                              "only its own update may read it", ident->name), ident->loc);
+                        return false;
+                    }
+                    break;
+                }
+                case ExpressionKind::Index: {
+                    Index *index = static_cast<Index *>(expr);
+                    auto table = const_map.find(index->table_name);
+                    if (table == const_map.end()) {
+                        ast_error(std::format("constant {} undeclared", index->table_name), index->loc);
+                        return false;
+                    }
+                    if (!type_bits(index->index->type)) {
+                        ast_error(std::format("index of constant {} is of type {}, integer expected",
+                                              index->table_name, type_to_string(index->index->type)),
+                                  index->index->loc);
+                        return false;
+                    }
+                    /* Other indices out of range read zero */
+                    if (index->index->kind == ExpressionKind::Integer
+                        && (static_cast<Integer *>(index->index)->value < table->second->from
+                            || static_cast<Integer *>(index->index)->value > table->second->to)) {
+                        ast_error(std::format("index {} is out of range of constant {}",
+                                              static_cast<Integer *>(index->index)->value, index->table_name),
+                                  index->index->loc);
+                        return false;
+                    }
+                    index->table = table->second;
+                    index->type = table->second->type;
                     break;
                 }
                 case ExpressionKind::Boolean:
@@ -154,19 +542,33 @@ bool SemanticAnalyser::resolve_types(Node *node) {
                     break;
                 case ExpressionKind::BinOp: {
                     BinOp *binop = static_cast<BinOp *>(expr);
+                    adapt_literal(binop->left, binop->right->type);
+                    adapt_literal(binop->right, binop->left->type);
                     switch (binop->kind) {
                         case BinOpKind::Leq:
                         case BinOpKind::Geq:
                         case BinOpKind::Gt:
-                        case BinOpKind::Lt:
-                            if (binop->left->type != Type::Int || binop->right->type != Type::Int) {
-                                ast_error("relation operator arguments must be int", binop->loc);
+                        case BinOpKind::Lt: {
+                            /* Comparing vectors gives a mask, lanes are -1 where true and 0 where false */
+                            Type type = lanewise_type(binop->left->type, binop->right->type);
+                            if (type == Type::None) {
+                                ast_error("relation operator arguments must be integers or vectors of int", binop->loc);
                                 return false;
                             }
-                            binop->type = Type::Bool;
+                            binop->type = type_lanes(type) ? type : Type::Bool;
                             break;
+                        }
                         case BinOpKind::Eq:
-                            if (binop->left->type != binop->right->type) {
+                            if (type_lanes(binop->left->type) || type_lanes(binop->right->type)) {
+                                binop->type = lanewise_type(binop->left->type, binop->right->type);
+                                if (binop->type == Type::None) {
+                                    ast_error("only values of same type may be compared", binop->loc);
+                                    return false;
+                                }
+                                break;
+                            }
+                            if (binop->left->type != binop->right->type
+                                && !(type_bits(binop->left->type) && type_bits(binop->right->type))) {
                                 ast_error("only values of same type may be compared", binop->loc);
                                 return false;
                             }
@@ -187,11 +589,15 @@ bool SemanticAnalyser::resolve_types(Node *node) {
                         case BinOpKind::Add:
                         case BinOpKind::Mult:
                         case BinOpKind::Sub:
-                            if (binop->left->type != Type::Int || binop->right->type != Type::Int) {
-                                ast_error("arithmetic operator arguments must be bool", binop->loc);
+                        case BinOpKind::Shl:
+                        case BinOpKind::Shr:
+                        case BinOpKind::Sar:
+                            binop->type = lanewise_type(binop->left->type, binop->right->type);
+                            if (binop->type == Type::None) {
+                                ast_error("arithmetic operator arguments must be integers or vectors of int",
+                                          binop->loc);
                                 return false;
                             }
-                            binop->type = Type::Int;
                             break;
                     }
                     break;
@@ -201,11 +607,11 @@ bool SemanticAnalyser::resolve_types(Node *node) {
                     switch (unop->kind) {
                         case UnOpKind::Neg:
                         case UnOpKind::Not:
-                            if (unop->arg->type != Type::Int) {
-                                ast_error("arithmetic operator argument must be bool", unop->loc);
+                            if (!type_bits(unop->arg->type) && !type_lanes(unop->arg->type)) {
+                                ast_error("arithmetic operator argument must be integer or vector of int", unop->loc);
                                 return false;
                             }
-                            unop->type = Type::Int;
+                            unop->type = unop->arg->type;
                             break;
                         case UnOpKind::LogNot:
                             if (unop->arg->type != Type::Bool) {
@@ -234,6 +640,14 @@ bool SemanticAnalyser::resolve_types(Node *node) {
     return true;
 }
 
+Spawn *SemanticAnalyser::pending_spawn(const std::string &var_name) {
+    for (Spawn *spawn : pending_spawns) {
+        if (spawn->var_name == var_name)
+            return spawn;
+    }
+    return nullptr;
+}
+
 bool SemanticAnalyser::resolve_call(const std::string &func_name, std::vector<Expression *> args,
                                     Function *&func, yy::location loc) {
     /* Handle builtins */
@@ -250,6 +664,11 @@ bool SemanticAnalyser::resolve_call(const std::string &func_name, std::vector<Ex
     }
     func = func_iter->second;
 
+    /* Record call graph edge, the callee has to be analysed as well */
+    if (std::find(current_func->callees.begin(), current_func->callees.end(), func) == current_func->callees.end())
+        current_func->callees.emplace_back(func);
+    mark_reachable(func);
+
     /* Check if arguments are correct */
     if (args.size() != func->params.size()) {
         ast_error(std::format("function {} takes {} arguments, {} given",
@@ -258,12 +677,13 @@ bool SemanticAnalyser::resolve_call(const std::string &func_name, std::vector<Ex
     }
     int i = 0;
     for (Expression *arg : args) {
-        if (arg->type != func->params[i].type) {
+        if (!converts(arg, func->params[i].type)) {
             ast_error(std::format("argument {} has type {}, {} expected",
                                   i, type_to_string(arg->type),
                                   type_to_string(func->params[i].type)), arg->loc);
             return false;
         }
+        i++;
     }
 
     /* Set expression type */
@@ -277,12 +697,16 @@ bool SemanticAnalyser::resolve_call(const std::string &func_name, std::vector<Ex
 bool SemanticAnalyser::resolve_builtin_call(const std::string &builtin_name, std::vector<Expression *> args,
                                             yy::location loc) {
     if (builtin_name == "return") {
+        if (current_parallel) {
+            ast_error("cannot return from inside parallel loop", loc);
+            return false;
+        }
         if (current_func->type != Type::Void) {
             if (args.size() != 1) {
                 ast_error(std::format("return builtin takes exactly 1 argument, {} given", args.size()), loc);
                 return false;
             }
-            if (args[0]->type != current_func->type) {
+            if (!converts(args[0], current_func->type)) {
                 ast_error(std::format("return type of function {} is {}, {} given",
                                       current_func->name,
                                       type_to_string(current_func->type),
@@ -299,22 +723,23 @@ bool SemanticAnalyser::resolve_builtin_call(const std::string &builtin_name, std
             Expression *expr = static_cast<Expression *>(current);
             expr->type = Type::Void;
         }
-    } else if (builtin_name == "read") {
+    } else if (builtin_name == "read" || builtin_name == "read_char") {
         if (args.size() != 0) {
-            ast_error(std::format("read builtin takes exactly 0 arguments, {} given", args.size()), loc);
+            ast_error(std::format("{} builtin takes exactly 0 arguments, {} given", builtin_name, args.size()), loc);
             return false;
         }
         if (current->kind == NodeKind::Expression) {
             Expression *expr = static_cast<Expression *>(current);
-            expr->type = Type::Int;
+            expr->type = builtin_name == "read" ? Type::Int : Type::Char;
         }
     } else if (builtin_name == "write") {
         if (args.size() != 1) {
             ast_error(std::format("write builtin takes exactly 1 argument, {} given", args.size()), loc);
             return false;
         }
-        if (args[0]->type != Type::Int) {
-            ast_error(std::format("write builtin takes int argument, {} given",
+        /* Chars are written as characters, other integers as numbers */
+        if (!type_bits(args[0]->type)) {
+            ast_error(std::format("write builtin takes integer argument, {} given",
                                   type_to_string(args[0]->type)), loc);
             return false;
         }
@@ -322,6 +747,43 @@ bool SemanticAnalyser::resolve_builtin_call(const std::string &builtin_name, std
             Expression *expr = static_cast<Expression *>(current);
             expr->type = Type::Void;
         }
+    } else if (is_bit_builtin(builtin_name)) {
+        size_t arity = builtin_name == "rotl" || builtin_name == "rotr" ? 2 : 1;
+        if (args.size() != arity) {
+            ast_error(std::format("{} builtin takes exactly {} argument{}, {} given",
+                                  builtin_name, arity, arity == 1 ? "" : "s", args.size()), loc);
+            return false;
+        }
+        if (arity == 2)
+            adapt_literal(args[1], args[0]->type);
+        Type type = arity == 1 ? args[0]->type : lanewise_type(args[0]->type, args[1]->type);
+        if (!type_bits(type) && !type_lanes(type)) {
+            ast_error(std::format("{} builtin takes integer or vector of int arguments", builtin_name), loc);
+            return false;
+        }
+        if (builtin_name == "bswap" && type == Type::Char) {
+            ast_error("bswap builtin takes an integer of at least 16 bits", loc);
+            return false;
+        }
+        if (current->kind != NodeKind::Expression) {
+            ast_error(std::format("result of {} builtin is discarded", builtin_name), loc);
+            return false;
+        }
+        static_cast<Expression *>(current)->type = type;
+    } else if (is_conversion_builtin(builtin_name)) {
+        /* Narrowing truncates, widening sign extends, bools become 0 or 1 */
+        if (args.size() != 1) {
+            ast_error(std::format("{} conversion takes exactly 1 argument, {} given", builtin_name, args.size()), loc);
+            return false;
+        }
+        if (!type_bits(args[0]->type) && args[0]->type != Type::Bool) {
+            ast_error(std::format("{} conversion takes integer or bool argument, {} given",
+                                  builtin_name, type_to_string(args[0]->type)), loc);
+            return false;
+        }
+        static_cast<Expression *>(current)->type = type_from_string(builtin_name);
+    } else if (is_vector_builtin(builtin_name)) {
+        return resolve_vector_builtin(builtin_name, args, loc);
     } else {
         ast_error(std::format("unknown builtin {}", builtin_name), loc);
         return false;
@@ -330,10 +792,200 @@ bool SemanticAnalyser::resolve_builtin_call(const std::string &builtin_name, std
     return true;
 }
 
+void SemanticAnalyser::mark_reachable(Function *func) {
+    if (!func->reachable) {
+        func->reachable = true;
+        worklist.emplace_back(func);
+    }
+}
+
 bool SemanticAnalyser::resolve_types() {
-    return resolve_types(static_cast<Node *>(program));
+    /* Only functions reachable from main or exported functions are analysed
+       (and compiled). A program without any of them is treated as a library
+       with all functions being entry points. */
+    for (Node *child : program->children) {
+        Function *func = static_cast<Function *>(child);
+        if (is_exported(func->name))
+            mark_reachable(func);
+    }
+    if (worklist.empty()) {
+        for (Node *child : program->children)
+            mark_reachable(static_cast<Function *>(child));
+    }
+    /* Initializers are only needed until they are evaluated */
+    for (Const *constant : program->consts)
+        mark_reachable(constant->init);
+
+    for (size_t i = 0; i < worklist.size(); i++) {
+        if (!resolve_types(static_cast<Node *>(worklist[i])))
+            return false;
+    }
+
+    if (verbose) {
+        for (Node *child : program->children) {
+            Function *func = static_cast<Function *>(child);
+            if (!func->reachable)
+                std::cerr << func->loc << ":" << std::endl
+                          << std::format("function {} is unreachable, skipped", func->name) << '\n';
+        }
+    }
+    return true;
+}
+
+bool SemanticAnalyser::resolve_vector_builtin(const std::string &builtin_name, std::vector<Expression *> args,
+                                              yy::location loc) {
+    if (current->kind != NodeKind::Expression) {
+        ast_error(std::format("result of {} builtin is discarded", builtin_name), loc);
+        return false;
+    }
+    Expression *expr = static_cast<Expression *>(current);
+
+    std::vector<Type> expected;
+    if (builtin_name == "splat4" || builtin_name == "splat8") {
+        expected = {Type::Int};
+        expr->type = builtin_name == "splat4" ? Type::Int4 : Type::Int8;
+    } else if (builtin_name == "vector") {
+        if (args.size() != 4 && args.size() != 8) {
+            ast_error(std::format("vector builtin takes 4 or 8 arguments, {} given", args.size()), loc);
+            return false;
+        }
+        expected.assign(args.size(), Type::Int);
+        expr->type = args.size() == 4 ? Type::Int4 : Type::Int8;
+    } else {
+        /* The rest operate on a vector given as the first argument */
+        if (args.empty() || !type_lanes(args[0]->type)) {
+            ast_error(std::format("{} builtin takes a vector as its first argument", builtin_name), loc);
+            return false;
+        }
+        Type vector = args[0]->type;
+        expected = {vector};
+        if (builtin_name == "lane") {
+            expected.emplace_back(Type::Int);
+            expr->type = Type::Int;
+        } else if (builtin_name == "insert") {
+            expected.insert(expected.end(), {Type::Int, Type::Int});
+            expr->type = vector;
+        } else if (builtin_name == "shuffle") {
+            expected.insert(expected.end(), type_lanes(vector), Type::Int);
+            expr->type = vector;
+        } else if (builtin_name == "select") {
+            expected.insert(expected.end(), {vector, vector});
+            expr->type = vector;
+        } else if (builtin_name == "any" || builtin_name == "all") {
+            expr->type = Type::Bool;
+        } else {
+            /* reduce_* */
+            expr->type = Type::Int;
+        }
+    }
+
+    if (args.size() != expected.size()) {
+        ast_error(std::format("{} builtin takes exactly {} arguments, {} given",
+                              builtin_name, expected.size(), args.size()), loc);
+        return false;
+    }
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i]->type != expected[i]) {
+            ast_error(std::format("argument {} of {} builtin has type {}, {} expected",
+                                  i, builtin_name, type_to_string(args[i]->type),
+                                  type_to_string(expected[i])), args[i]->loc);
+            return false;
+        }
+    }
+
+    /* Shuffle masks are part of the instruction */
+    if (builtin_name == "shuffle") {
+        int lanes = type_lanes(args[0]->type);
+        for (size_t i = 1; i < args.size(); i++) {
+            if (args[i]->kind != ExpressionKind::Integer || static_cast<Integer *>(args[i])->value < 0
+                || static_cast<Integer *>(args[i])->value >= lanes) {
+                ast_error(std::format("shuffle indices must be integer literals from 0 to {}", lanes - 1),
+                          args[i]->loc);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool SemanticAnalyser::check_pure(const std::string &what, Node *node, std::unordered_set<Function *> &visited) {
+    if (node->kind == NodeKind::Statement || node->kind == NodeKind::Expression) {
+        const std::string *func_name = nullptr;
+        Function *func = nullptr;
+        if (node->kind == NodeKind::Statement && static_cast<Statement *>(node)->kind == StatementKind::Call) {
+            func_name = &static_cast<Call *>(node)->func_name;
+            func = static_cast<Call *>(node)->func;
+        } else if (node->kind == NodeKind::Expression
+                   && static_cast<Expression *>(node)->kind == ExpressionKind::CallExpr) {
+            func_name = &static_cast<CallExpr *>(node)->func_name;
+            func = static_cast<CallExpr *>(node)->func;
+        }
+
+        if (func_name && (*func_name == "read" || *func_name == "read_char" || *func_name == "write")) {
+            ast_error(std::format("{} is not pure, {} builtin called", what, *func_name), node->loc);
+            return false;
+        }
+        /* Functions called from it have to be pure too */
+        if (func && visited.insert(func).second && !check_pure(what, func, visited))
+            return false;
+    }
+
+    for (Node *child : node->children) {
+        if (!check_pure(what, child, visited))
+            return false;
+    }
+    return true;
+}
+
+bool SemanticAnalyser::check_memo(Function *func) {
+    if (func->type != Type::Int && func->type != Type::Bool) {
+        ast_error(std::format("memo function {} must return int or bool, {} given",
+                              func->name, type_to_string(func->type)), func->loc);
+        return false;
+    }
+    for (Parameter &param : func->params) {
+        if (param.type != Type::Int && param.type != Type::Bool) {
+            ast_error(std::format("memo function {} has parameter {} of type {}, int or bool expected",
+                                  func->name, param.name, type_to_string(param.type)), func->loc);
+            return false;
+        }
+    }
+    if (func->memo_capacity < 0) {
+        ast_error(std::format("memo function {} has negative capacity {}",
+                              func->name, func->memo_capacity), func->loc);
+        return false;
+    }
+
+    std::unordered_set<Function *> visited = {func};
+    return check_pure(std::format("memo function {}", func->name), func, visited);
+}
+
+bool SemanticAnalyser::check_memo() {
+    for (Node *child : program->children) {
+        Function *func = static_cast<Function *>(child);
+        if (func->memo && func->reachable && !check_memo(func))
+            return false;
+    }
+    return true;
+}
+
+/* Initializers are evaluated at compile time, so they must not do I/O */
+bool SemanticAnalyser::check_consts() {
+    for (Const *constant : program->consts) {
+        std::unordered_set<Function *> visited = {constant->init};
+        if (!check_pure(std::format("constant {}", constant->name), constant->init, visited))
+            return false;
+    }
+    return true;
 }
 
 bool SemanticAnalyser::analyse() {
-    return scan_functions() && resolve_types();
+    return scan_functions() && resolve_types() && check_memo() && check_consts();
+}
+
+/* Analyses a single function against the signatures of the program, which
+   are all scanned beforehand. Used when compiling function by function. */
+bool SemanticAnalyser::analyse_function(Function *func) {
+    func->reachable = true;
+    return resolve_types(static_cast<Node *>(func)) && (!func->memo || check_memo(func));
 }
\ No newline at end of file
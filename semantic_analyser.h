@@ -2,6 +2,7 @@
 #define EPICA_SEMANTIC_ANALYSER_H
 
 #include <unordered_map>
+#include <unordered_set>
 #include "ast.h"
 
 class SemanticAnalyser {
@@ -9,18 +10,34 @@ private:
     Program *program;
     Node *current;
     std::unordered_map<std::string, Function *> function_map;
+    std::unordered_map<std::string, Const *> const_map;
     Function *current_func;
     std::unordered_map<std::string, Parameter> current_params;
     std::unordered_map<std::string, Variable *> current_vars;
+    Parallel *current_parallel;
+    Identifier *reduction_operand; /* left operand of the current update of the reduction variable */
+    std::unordered_set<std::string> parallel_captured;
+    std::vector<Spawn *> pending_spawns;
+    std::vector<std::string> loop_vars; /* induction variables of enclosing for loops */
+    std::vector<Function *> worklist;
+    bool verbose;
 
     bool resolve_types(Node *node);
     bool resolve_call(const std::string &func_name, std::vector<Expression *> args, Function *&func, yy::location loc);
     bool resolve_builtin_call(const std::string &builtin_name, std::vector<Expression *> args, yy::location loc);
+    bool resolve_vector_builtin(const std::string &builtin_name, std::vector<Expression *> args, yy::location loc);
+    void mark_reachable(Function *func);
+    Spawn *pending_spawn(const std::string &var_name);
+    bool check_pure(const std::string &what, Node *node, std::unordered_set<Function *> &visited);
+    bool check_memo(Function *func);
 public:
-    SemanticAnalyser(Program *program);
+    SemanticAnalyser(Program *program, bool verbose = false);
     bool scan_functions();
     bool resolve_types();
+    bool check_memo();
+    bool check_consts();
     bool analyse();
+    bool analyse_function(Function *func);
 };
 
 #endif //EPICA_SEMANTIC_ANALYSER_H
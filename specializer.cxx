@@ -0,0 +1,407 @@
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <format>
+#include <iostream>
+#include "specializer.h"
+
+/* Budget: functions larger than this many nodes are not cloned, and there
+   are at most so many clones of a function and in total */
+static const size_t max_size = 400;
+static const int max_function_clones = 4;
+static const int max_clones = 64;
+
+static bool assigns(Node *node, const std::string &name) {
+    if (node->kind == NodeKind::Statement) {
+        Statement *statement = static_cast<Statement *>(node);
+        if ((statement->kind == StatementKind::Assignment && static_cast<Assignment *>(statement)->var_name == name)
+            || (statement->kind == StatementKind::Spawn && static_cast<Spawn *>(statement)->var_name == name))
+            return true;
+    }
+    for (Node *child : node->children) {
+        if (assigns(child, name))
+            return true;
+    }
+    return false;
+}
+
+static void collect_identifiers(Node *node, std::unordered_set<std::string> &names) {
+    if (node->kind == NodeKind::Expression && static_cast<Expression *>(node)->kind == ExpressionKind::Identifier)
+        names.insert(static_cast<Identifier *>(node)->name);
+    for (Node *child : node->children)
+        collect_identifiers(child, names);
+}
+
+/* Variables declared in a pruned branch may still be used after it */
+static void collect_declarations(Node *node, std::vector<Statement *> &declarations) {
+    if (node->kind != NodeKind::Statement)
+        return;
+    Statement *statement = static_cast<Statement *>(node);
+    if (statement->kind == StatementKind::Variable)
+        declarations.emplace_back(statement);
+    for (Node *child : node->children) {
+        /* Induction variables are private to their loop */
+        if ((statement->kind == StatementKind::For && child == static_cast<For *>(statement)->var)
+            || (statement->kind == StatementKind::Parallel && child == static_cast<Parallel *>(statement)->var))
+            continue;
+        collect_declarations(child, declarations);
+    }
+}
+
+static Statement *prune(Statement *kept, std::vector<Statement *> pruned, yy::location loc) {
+    std::vector<Statement *> statements;
+    for (Statement *statement : pruned) {
+        if (statement)
+            collect_declarations(statement, statements);
+    }
+    if (statements.empty() && kept)
+        return kept;
+    if (kept)
+        statements.emplace_back(kept);
+    return new Block(statements, loc);
+}
+
+static Expression *literal(Type type, long value, yy::location loc) {
+    Expression *expr;
+    if (type == Type::Bool) {
+        expr = new Boolean(value != 0, loc);
+    } else {
+        /* Narrow results wrap around, int literals hold 32 bits so larger
+           results are left unfolded */
+        if (type_bits(type) < 64)
+            value = static_cast<long>(static_cast<unsigned long>(value) << (64 - type_bits(type)))
+                    >> (64 - type_bits(type));
+        if (value < INT_MIN || value > INT_MAX)
+            return nullptr;
+        expr = new Integer(static_cast<int>(value), loc);
+    }
+    expr->type = type;
+    return expr;
+}
+
+static bool literal_value(Expression *expr, long &value) {
+    if (expr->kind == ExpressionKind::Integer)
+        value = static_cast<Integer *>(expr)->value;
+    else if (expr->kind == ExpressionKind::Boolean)
+        value = static_cast<Boolean *>(expr)->value;
+    else
+        return false;
+    return true;
+}
+
+/* Folds an operation on literals, with the same semantics as compiled code */
+static Expression *fold(Expression *expr) {
+    if (expr->kind == ExpressionKind::Index) {
+        /* Constant tables are evaluated by now */
+        Index *index = static_cast<Index *>(expr);
+        long at;
+        if (!literal_value(index->index, at))
+            return expr;
+        Const *table = index->table;
+        long value = at >= table->from && at <= table->to ? table->values[at - table->from] : 0;
+        Expression *folded = literal(index->type, value, index->loc);
+        return folded ? folded : expr;
+    }
+    if (expr->kind == ExpressionKind::UnOp) {
+        UnOp *unop = static_cast<UnOp *>(expr);
+        long arg;
+        if (!literal_value(unop->arg, arg))
+            return expr;
+        long result = unop->kind == UnOpKind::Neg ? static_cast<long>(0ul - arg)
+                      : unop->kind == UnOpKind::Not ? ~arg : !arg;
+        Expression *folded = literal(unop->type, result, unop->loc);
+        return folded ? folded : expr;
+    }
+    if (expr->kind != ExpressionKind::BinOp)
+        return expr;
+
+    BinOp *binop = static_cast<BinOp *>(expr);
+    long left_value, right_value;
+    if (!literal_value(binop->left, left_value) || !literal_value(binop->right, right_value))
+        return expr;
+    unsigned long left = left_value;
+    unsigned long right = right_value;
+    /* Operands are sign extended, shifts work on the width of the wider one */
+    unsigned bits = std::max(type_bits(binop->left->type), type_bits(binop->right->type));
+    unsigned long shift = right & ((bits ? bits : 64) - 1);
+    unsigned long mask = bits && bits < 64 ? (1ul << bits) - 1 : ~0ul;
+    long result;
+    switch (binop->kind) {
+        case BinOpKind::Add:
+            result = static_cast<long>(left + right);
+            break;
+        case BinOpKind::Sub:
+            result = static_cast<long>(left - right);
+            break;
+        case BinOpKind::Mult:
+            result = static_cast<long>(left * right);
+            break;
+        case BinOpKind::Or:
+        case BinOpKind::LogOr:
+            result = static_cast<long>(left | right);
+            break;
+        case BinOpKind::And:
+        case BinOpKind::LogAnd:
+            result = static_cast<long>(left & right);
+            break;
+        case BinOpKind::Xor:
+        case BinOpKind::LogXor:
+            result = static_cast<long>(left ^ right);
+            break;
+        case BinOpKind::Shl:
+            result = static_cast<long>(left << shift);
+            break;
+        case BinOpKind::Shr:
+            result = static_cast<long>((left & mask) >> shift);
+            break;
+        case BinOpKind::Sar:
+            result = left_value >> shift;
+            break;
+        case BinOpKind::Eq:
+            result = left == right;
+            break;
+        case BinOpKind::Lt:
+            result = left_value < right_value;
+            break;
+        case BinOpKind::Gt:
+            result = left_value > right_value;
+            break;
+        case BinOpKind::Leq:
+            result = left_value <= right_value;
+            break;
+        case BinOpKind::Geq:
+            result = left_value >= right_value;
+            break;
+    }
+    Expression *folded = literal(binop->type, result, binop->loc);
+    return folded ? folded : expr;
+}
+
+Specializer::Specializer(Program *program, bool verbose) : program(program), verbose(verbose), total_clones(0) {}
+
+/* Parameters used in branch predicates, case selectors and loop bounds */
+const std::unordered_set<std::string> &Specializer::get_controlling(Function *func) {
+    auto found = controlling.find(func);
+    if (found != controlling.end())
+        return found->second;
+
+    std::unordered_set<std::string> names;
+    std::vector<Node *> pending = {func->body};
+    while (!pending.empty()) {
+        Node *node = pending.back();
+        pending.pop_back();
+        if (node->kind == NodeKind::Statement) {
+            Statement *statement = static_cast<Statement *>(node);
+            if (statement->kind == StatementKind::If) {
+                collect_identifiers(static_cast<If *>(statement)->pred, names);
+            } else if (statement->kind == StatementKind::While) {
+                collect_identifiers(static_cast<While *>(statement)->pred, names);
+            } else if (statement->kind == StatementKind::Case) {
+                collect_identifiers(static_cast<Case *>(statement)->expr, names);
+            } else if (statement->kind == StatementKind::For) {
+                collect_identifiers(static_cast<For *>(statement)->from, names);
+                collect_identifiers(static_cast<For *>(statement)->to, names);
+            } else if (statement->kind == StatementKind::Parallel) {
+                collect_identifiers(static_cast<Parallel *>(statement)->from, names);
+                collect_identifiers(static_cast<Parallel *>(statement)->to, names);
+            }
+        }
+        pending.insert(pending.end(), node->children.begin(), node->children.end());
+    }
+
+    std::unordered_set<std::string> &params = controlling[func];
+    for (Parameter &param : func->params) {
+        if (names.contains(param.name))
+            params.insert(param.name);
+    }
+    return params;
+}
+
+void Specializer::specialize(Node *node, Function *caller) {
+    for (Node *child : node->children)
+        specialize(child, caller);
+
+    Function *callee;
+    std::vector<Expression *> *args;
+    if (node->kind == NodeKind::Statement && static_cast<Statement *>(node)->kind == StatementKind::Call) {
+        callee = static_cast<Call *>(node)->func;
+        args = &static_cast<Call *>(node)->args;
+    } else if (node->kind == NodeKind::Expression
+               && static_cast<Expression *>(node)->kind == ExpressionKind::CallExpr) {
+        callee = static_cast<CallExpr *>(node)->func;
+        args = &static_cast<CallExpr *>(node)->args;
+    } else {
+        return;
+    }
+    /* Memo functions keep a single cache */
+    if (!callee || callee->memo)
+        return;
+
+    const std::unordered_set<std::string> &names = get_controlling(callee);
+    Binding binding;
+    for (size_t i = 0; i < args->size(); i++) {
+        const Parameter &param = callee->params[i];
+        long value;
+        if (names.contains(param.name) && (param.type == Type::Int || param.type == Type::Bool)
+            && literal_value((*args)[i], value))
+            binding.emplace_back(i, value);
+    }
+    if (binding.empty())
+        return;
+    Function *spec = get_clone(callee, binding);
+    if (!spec)
+        return;
+
+    /* Redirect the call, dropping the bound arguments */
+    std::vector<Expression *> remaining;
+    for (size_t i = 0, j = 0; i < args->size(); i++) {
+        if (j < binding.size() && binding[j].first == i)
+            j++;
+        else
+            remaining.emplace_back((*args)[i]);
+    }
+    *args = remaining;
+    node->children.assign(remaining.begin(), remaining.end());
+    if (node->kind == NodeKind::Statement) {
+        static_cast<Call *>(node)->func = spec;
+        static_cast<Call *>(node)->func_name = spec->name;
+    } else {
+        static_cast<CallExpr *>(node)->func = spec;
+        static_cast<CallExpr *>(node)->func_name = spec->name;
+    }
+    if (std::find(caller->callees.begin(), caller->callees.end(), spec) == caller->callees.end())
+        caller->callees.emplace_back(spec);
+}
+
+Function *Specializer::get_clone(Function *func, const Binding &binding) {
+    auto found = clones.find({func, binding});
+    if (found != clones.end())
+        return found->second;
+    if (total_clones >= max_clones || clone_counts[func] >= max_function_clones || tree_size(func) > max_size)
+        return nullptr;
+
+    std::vector<Parameter> params;
+    std::unordered_map<std::string, long> bound;
+    std::vector<Statement *> prologue;
+    for (size_t i = 0, j = 0; i < func->params.size(); i++) {
+        Parameter &param = func->params[i];
+        if (j == binding.size() || binding[j].first != i) {
+            params.emplace_back(param);
+            continue;
+        }
+        long value = binding[j++].second;
+        if (assigns(func->body, param.name)) {
+            /* Assigned parameters become variables starting with the value */
+            prologue.emplace_back(new Variable(param.type, param.name, func->loc));
+            prologue.emplace_back(new Assignment(param.name, literal(param.type, value, func->loc), func->loc));
+        } else {
+            bound.insert({param.name, value});
+        }
+    }
+
+    Block *body = static_cast<Block *>(clone(func->body, bound));
+    body->children.insert(body->children.begin(), prologue.begin(), prologue.end());
+    body = static_cast<Block *>(simplify(body));
+
+    Function *spec = new Function(func->type, std::format("{}.spec{}", func->name, total_clones), params, body,
+                                  func->loc);
+    spec->hot = func->hot;
+    spec->inline_hint = func->inline_hint;
+    spec->reachable = true;
+    spec->callees = func->callees;
+    program->children.emplace_back(spec);
+    clones.insert({{func, binding}, spec});
+    clone_counts[func]++;
+    total_clones++;
+    worklist.emplace_back(spec);
+
+    if (verbose) {
+        std::string values;
+        for (auto &[index, value] : binding)
+            values += std::format("{}{} = {}", values.empty() ? "" : ", ", func->params[index].name, value);
+        std::cerr << func->loc << ":" << std::endl
+                  << std::format("function {} specialized for {} as {}", func->name, values, spec->name) << '\n';
+    }
+    return spec;
+}
+
+Node *Specializer::clone(Node *node, const std::unordered_map<std::string, long> &bound) {
+    if (node->kind == NodeKind::Expression && static_cast<Expression *>(node)->kind == ExpressionKind::Identifier) {
+        Identifier *ident = static_cast<Identifier *>(node);
+        auto value = bound.find(ident->name);
+        if (value != bound.end())
+            return literal(ident->type, value->second, ident->loc);
+    }
+
+    Node *copy = copy_node(node);
+    std::unordered_map<Node *, Node *> map;
+    for (Node *&child : copy->children) {
+        Node *child_copy = clone(child, bound);
+        map.insert({child, child_copy});
+        child = child_copy;
+    }
+    remap_children(copy, map);
+    return copy;
+}
+
+Node *Specializer::simplify(Node *node) {
+    std::unordered_map<Node *, Node *> map;
+    for (Node *&child : node->children) {
+        Node *simplified = simplify(child);
+        map.insert({child, simplified});
+        child = simplified;
+    }
+    remap_children(node, map);
+
+    if (node->kind == NodeKind::Expression)
+        return fold(static_cast<Expression *>(node));
+
+    Statement *statement = static_cast<Statement *>(node);
+    long value;
+    switch (statement->kind) {
+        case StatementKind::If: {
+            If *i = static_cast<If *>(statement);
+            if (!literal_value(i->pred, value))
+                break;
+            return value ? prune(i->positive, {i->negative}, i->loc) : prune(i->negative, {i->positive}, i->loc);
+        }
+        case StatementKind::While: {
+            /* The body runs once before the predicate is tested */
+            While *wh = static_cast<While *>(statement);
+            if (literal_value(wh->pred, value) && !value)
+                return wh->body;
+            break;
+        }
+        case StatementKind::Case: {
+            Case *c = static_cast<Case *>(statement);
+            if (!literal_value(c->expr, value))
+                break;
+            Statement *taken = c->otherwise;
+            std::vector<Statement *> pruned;
+            for (CaseArm &arm : c->arms) {
+                for (Expression *label : arm.labels) {
+                    if (static_cast<Integer *>(label)->value == value)
+                        taken = arm.body;
+                }
+                pruned.emplace_back(arm.body);
+            }
+            pruned.emplace_back(c->otherwise);
+            std::erase(pruned, taken);
+            return prune(taken, pruned, c->loc);
+        }
+        default:
+            ;
+    }
+    return node;
+}
+
+void Specializer::run() {
+    for (Node *child : program->children) {
+        Function *func = static_cast<Function *>(child);
+        if (func->reachable)
+            worklist.emplace_back(func);
+    }
+    /* Clones are specialized further as they are created */
+    for (size_t i = 0; i < worklist.size(); i++)
+        specialize(worklist[i]->body, worklist[i]);
+}
@@ -0,0 +1,37 @@
+#ifndef EPICA_SPECIALIZER_H
+#define EPICA_SPECIALIZER_H
+
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include "ast.h"
+
+/* Function specialization on the analysed AST: calls passing integer or
+   boolean literals for parameters which the callee branches on are
+   redirected to a clone of the callee with those parameters bound. The
+   clone is simplified, i.e. constant expressions are folded and branches
+   decided by the bound values are pruned. */
+class Specializer {
+private:
+    /* Bound parameters by index and their values */
+    typedef std::vector<std::pair<size_t, long>> Binding;
+
+    Program *program;
+    bool verbose;
+    std::map<std::pair<Function *, Binding>, Function *> clones;
+    std::unordered_map<Function *, std::unordered_set<std::string>> controlling;
+    std::unordered_map<Function *, int> clone_counts;
+    std::vector<Function *> worklist;
+    int total_clones;
+
+    const std::unordered_set<std::string> &get_controlling(Function *func);
+    void specialize(Node *node, Function *caller);
+    Function *get_clone(Function *func, const Binding &binding);
+    Node *clone(Node *node, const std::unordered_map<std::string, long> &bound);
+    Node *simplify(Node *node);
+public:
+    Specializer(Program *program, bool verbose = false);
+    void run();
+};
+
+#endif //EPICA_SPECIALIZER_H
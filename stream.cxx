@@ -0,0 +1,244 @@
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <unordered_set>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+#include "stream.h"
+#include "codegen_llvm.h"
+#include "error.h"
+
+StreamCompiler::StreamCompiler(Driver &driver, const std::string &output_dir, int opt_level, bool verbose,
+                               std::shared_ptr<llvm::TargetMachine> target, bool multiversion)
+    : driver(driver), output_dir(output_dir), opt_level(opt_level), verbose(verbose), target(std::move(target)),
+      multiversion(multiversion), signatures(nullptr), done(false), failed(false) {}
+
+void StreamCompiler::summarise(Node *node, Summary &summary) {
+    const std::string *func_name = nullptr;
+    if (node->kind == NodeKind::Statement && static_cast<Statement *>(node)->kind == StatementKind::Call)
+        func_name = &static_cast<Call *>(node)->func_name;
+    else if (node->kind == NodeKind::Expression && static_cast<Expression *>(node)->kind == ExpressionKind::CallExpr)
+        func_name = &static_cast<CallExpr *>(node)->func_name;
+
+    if (func_name && (*func_name == "read" || *func_name == "read_char" || *func_name == "write")) {
+        if (summary.impure_builtin.empty()) {
+            summary.impure_builtin = *func_name;
+            summary.impure_loc = node->loc;
+        }
+    } else if (func_name && !is_builtin(*func_name)) {
+        summary.callees.emplace_back(*func_name);
+    }
+
+    for (Node *child : node->children)
+        summarise(child, summary);
+}
+
+bool StreamCompiler::scan(Function *func) {
+    /* Signatures are kept until the end, outside of the node arena */
+    Function *signature = ::new Function(func->type, func->name, func->params, nullptr, func->loc);
+    signature->children.clear();
+    signature->memo = func->memo;
+    signature->memo_capacity = func->memo_capacity;
+    signature->hot = func->hot;
+    signature->inline_hint = func->inline_hint;
+
+    summaries.emplace_back();
+    summarise(func, summaries.back());
+
+    delete func;
+    Node::arena_release(mark);
+    /* The list of signatures is in the arena, below the next mark */
+    signatures->children.emplace_back(signature);
+    mark = Node::arena_mark();
+    return true;
+}
+
+bool StreamCompiler::check_signatures() {
+    if (!analyser->scan_functions())
+        return false;
+    for (size_t i = 0; i < signatures->children.size(); i++)
+        index.insert({static_cast<Function *>(signatures->children[i])->name, i});
+
+    /* Reachability as in the semantic analyser, from the call summaries */
+    std::vector<size_t> worklist;
+    for (size_t i = 0; i < signatures->children.size(); i++) {
+        if (is_exported(static_cast<Function *>(signatures->children[i])->name))
+            worklist.emplace_back(i);
+    }
+    if (worklist.empty()) {
+        for (size_t i = 0; i < signatures->children.size(); i++)
+            worklist.emplace_back(i);
+    }
+    for (size_t i : worklist)
+        static_cast<Function *>(signatures->children[i])->reachable = true;
+    while (!worklist.empty()) {
+        size_t i = worklist.back();
+        worklist.pop_back();
+        for (const std::string &callee : summaries[i].callees) {
+            auto found = index.find(callee);
+            if (found == index.end())
+                continue;
+            Function *func = static_cast<Function *>(signatures->children[found->second]);
+            if (!func->reachable) {
+                func->reachable = true;
+                worklist.emplace_back(found->second);
+            }
+        }
+    }
+
+    /* Memo functions must not reach read or write through any call */
+    for (size_t i = 0; i < signatures->children.size(); i++) {
+        Function *memo_func = static_cast<Function *>(signatures->children[i]);
+        if (!memo_func->memo || !memo_func->reachable)
+            continue;
+        std::unordered_set<size_t> visited = {i};
+        std::vector<size_t> pending = {i};
+        while (!pending.empty()) {
+            Summary &summary = summaries[pending.back()];
+            pending.pop_back();
+            if (!summary.impure_builtin.empty()) {
+                ast_error(std::format("memo function {} is not pure, {} builtin called",
+                                      memo_func->name, summary.impure_builtin), summary.impure_loc);
+                return false;
+            }
+            for (const std::string &callee : summary.callees) {
+                auto found = index.find(callee);
+                if (found != index.end() && visited.insert(found->second).second)
+                    pending.emplace_back(found->second);
+            }
+        }
+    }
+
+    if (verbose) {
+        for (Node *child : signatures->children) {
+            Function *func = static_cast<Function *>(child);
+            if (!func->reachable)
+                std::cerr << func->loc << ":" << std::endl
+                          << std::format("function {} is unreachable, skipped", func->name) << '\n';
+        }
+    }
+    return true;
+}
+
+bool StreamCompiler::compile(Function *func) {
+    Function *signature = static_cast<Function *>(signatures->children[index[func->name]]);
+    if (!signature->reachable)
+        return true;
+    if (!analyser->analyse_function(func))
+        return false;
+
+    CodegenLLVM codegen(signatures);
+    codegen.set_target(target, multiversion);
+    std::unique_ptr<llvm::Module> mod(codegen.compile_function(func));
+    std::string path = std::format("{}/{}.o", output_dir, objects.size());
+    objects.emplace_back(path);
+
+    /* The queue is bounded, so that memory stays flat when the emitter
+       cannot keep up */
+    std::unique_lock<std::mutex> lock(queue_lock);
+    queue_cond.wait(lock, [this] { return queue.size() < 4 || failed; });
+    if (failed)
+        return false;
+    queue.emplace_back(Job{codegen.take_context(), std::move(mod), path});
+    queue_cond.notify_all();
+    return true;
+}
+
+bool StreamCompiler::emit(Job &job) {
+    static const llvm::OptimizationLevel levels[] = {
+        llvm::OptimizationLevel::O0,
+        llvm::OptimizationLevel::O1,
+        llvm::OptimizationLevel::O2,
+        llvm::OptimizationLevel::O3,
+    };
+
+    llvm::LoopAnalysisManager lam;
+    llvm::FunctionAnalysisManager fam;
+    llvm::CGSCCAnalysisManager cgam;
+    llvm::ModuleAnalysisManager mam;
+    llvm::PassBuilder pb(target.get());
+    pb.registerModuleAnalyses(mam);
+    pb.registerCGSCCAnalyses(cgam);
+    pb.registerFunctionAnalyses(fam);
+    pb.registerLoopAnalyses(lam);
+    pb.crossRegisterProxies(lam, fam, cgam, mam);
+    if (opt_level == 0)
+        pb.buildO0DefaultPipeline(levels[0]).run(*job.mod, mam);
+    else
+        pb.buildPerModuleDefaultPipeline(levels[opt_level]).run(*job.mod, mam);
+
+    std::error_code error;
+    llvm::raw_fd_ostream out(job.path, error, llvm::sys::fs::OF_None);
+    if (error) {
+        std::cerr << "stream: cannot write " << job.path << ": " << error.message() << std::endl;
+        return false;
+    }
+    llvm::legacy::PassManager pm;
+    if (target->addPassesToEmitFile(pm, out, nullptr, llvm::CGFT_ObjectFile)) {
+        std::cerr << "stream: target cannot emit object files" << std::endl;
+        return false;
+    }
+    pm.run(*job.mod);
+    return true;
+}
+
+void StreamCompiler::emit_loop() {
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(queue_lock);
+            queue_cond.wait(lock, [this] { return !queue.empty() || done; });
+            if (queue.empty())
+                return;
+            job = std::move(queue.front());
+            queue.pop_front();
+            queue_cond.notify_all();
+        }
+        if (!emit(job)) {
+            std::lock_guard<std::mutex> lock(queue_lock);
+            failed = true;
+            queue_cond.notify_all();
+            return;
+        }
+    }
+}
+
+bool StreamCompiler::run(const std::string &file) {
+    /* Everything the parser allocates after this point belongs to the
+       function being parsed */
+    driver.root = new Program(yy::location());
+    mark = Node::arena_mark();
+    signatures = ::new Program(yy::location());
+
+    driver.on_function = [this](Function *func) { return scan(func); };
+    if (driver.parse(file))
+        return false;
+    analyser = std::make_unique<SemanticAnalyser>(signatures, verbose);
+    if (!check_signatures())
+        return false;
+
+    emitter = std::thread(&StreamCompiler::emit_loop, this);
+    driver.on_function = [this](Function *func) {
+        bool compiled = compile(func);
+        delete func;
+        Node::arena_release(mark);
+        return compiled;
+    };
+    bool parsed = !driver.parse(file);
+    {
+        std::lock_guard<std::mutex> lock(queue_lock);
+        done = true;
+        queue_cond.notify_all();
+    }
+    emitter.join();
+    if (!parsed || failed)
+        return false;
+
+    /* List of objects for the linker, e.g. gcc @<dir>/objects */
+    std::ofstream list(output_dir + "/objects");
+    for (const std::string &object : objects)
+        list << object << '\n';
+    return static_cast<bool>(list);
+}
@@ -0,0 +1,69 @@
+#ifndef EPICA_STREAM_H
+#define EPICA_STREAM_H
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
+#include "ast.h"
+#include "main.h"
+#include "semantic_analyser.h"
+
+/* Streaming compilation: a first pass parses the whole source, but keeps
+   only the signatures of functions and what they call, releasing each
+   function's AST right away. It costs a second parse, not memory. In the
+   second pass every function is analysed, lowered and handed over to the
+   emitter thread as soon as it is parsed, and its AST is released before
+   the next one is parsed. The emitter optimizes each function and writes
+   it into an object file of its own. */
+class StreamCompiler {
+private:
+    struct Summary {
+        std::vector<std::string> callees;
+        std::string impure_builtin; /* read or write called directly, if any */
+        yy::location impure_loc;
+    };
+    struct Job {
+        std::unique_ptr<llvm::LLVMContext> context;
+        std::unique_ptr<llvm::Module> mod;
+        std::string path;
+    };
+
+    Driver &driver;
+    std::string output_dir;
+    int opt_level;
+    bool verbose;
+    std::shared_ptr<llvm::TargetMachine> target;
+    bool multiversion;
+    Program *signatures;
+    std::vector<Summary> summaries;
+    std::unordered_map<std::string, size_t> index;
+    std::unique_ptr<SemanticAnalyser> analyser;
+    Node::ArenaMark mark;
+    std::vector<std::string> objects;
+
+    /* Owned by the emitter thread */
+    std::thread emitter;
+    std::mutex queue_lock;
+    std::condition_variable queue_cond;
+    std::deque<Job> queue;
+    bool done;
+    bool failed;
+
+    bool scan(Function *func);
+    void summarise(Node *node, Summary &summary);
+    bool check_signatures();
+    bool compile(Function *func);
+    void emit_loop();
+    bool emit(Job &job);
+public:
+    StreamCompiler(Driver &driver, const std::string &output_dir, int opt_level, bool verbose,
+                   std::shared_ptr<llvm::TargetMachine> target, bool multiversion);
+    bool run(const std::string &file);
+};
+
+#endif //EPICA_STREAM_H